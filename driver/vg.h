@@ -2,9 +2,428 @@
 #define VG_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
+#include <linux/fb.h>
 
 #define VG_MAGIC 0x5647
 
+#define VGFBM_MAX_RECTS 4096
+#define VGFBM_CURSOR_MAX 64
+#define VGFBM_MAX_BUFFERS 8
+#define VGFBM_THUMBNAIL_MAX_SHIFT 3
+#define VGFBM_MAX_PITCH_ALIGN 4096
+#define VGFBM_MAX_RING_SLOTS 64
+#define VGFBM_MAX_COMMANDS 256
+#define VGFB_MAX_DRAW_OPS 4096
+
+/*
+ * mmap offsets on the master. The screen memory starts at offset 0 and
+ * can't grow beyond VGFBM_MMAP_STATUS.
+ */
+#define VGFBM_MMAP_STATUS 0x40000000u
+#define VGFBM_MMAP_RING 0x50000000u
+#define VGFBM_MMAP_SNAPSHOT 0x60000000u
+
+/*
+ * A rectangle of the virtual screen, in pixels. offset is the byte offset
+ * of its first pixel in the caller's buffer, rows follow each other
+ * stride bytes apart.
+ */
+struct vgfbm_rect {
+	__u32 x;
+	__u32 y;
+	__u32 width;
+	__u32 height;
+	__u64 offset;
+};
+
+struct vgfbm_rects {
+	__u64 buffer;
+	__u64 buffer_size;
+	__u64 rects;
+	__u32 count;
+	__u32 stride;
+};
+
+struct vgfbm_damage {
+	__u32 x;
+	__u32 y;
+	__u32 width;
+	__u32 height;
+};
+
+/*
+ * A consistent view of the device. frame_seq counts pans (flips),
+ * generation counts screen buffer reallocations, after which mappings of
+ * the old buffer no longer show the screen. damage is the bounding box of
+ * everything drawn since the previous VGFBM_GET_FRAME_STATE, it's empty if
+ * width is 0.
+ */
+struct vgfbm_frame_state {
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	__u64 frame_seq;
+	__u64 generation;
+	struct vgfbm_damage damage;
+};
+
+/*
+ * Read only page mapped at VGFBM_MMAP_STATUS. seq is odd while the driver
+ * updates the page; read seq, the fields and seq again, and retry if seq
+ * was odd or changed. damage is the pending damage which the next
+ * VGFBM_GET_FRAME_STATE returns, damage_seq changes whenever it grows.
+ * blank is the deepest FB_BLANK_* level the guest or the master asked for.
+ * Blanked devices don't collect damage or count vblanks. The cursor_*
+ * fields describe the cursor plane, see struct vgfbm_cursor.
+ * dropped_draws counts console draws which lost pixels because screen
+ * memory couldn't be allocated where the console draws, the driver
+ * allocates it afterwards for the next ones.
+ */
+struct vgfbm_status {
+	__u32 seq;
+	__u32 xres;
+	__u32 yres;
+	__u32 xres_virtual;
+	__u32 yres_virtual;
+	__u32 line_length;
+	__u32 xoffset;
+	__u32 yoffset;
+	__u64 frame_seq;
+	__u64 vblank_seq;
+	__u64 damage_seq;
+	__u64 generation;
+	struct vgfbm_damage damage;
+	__u64 acked_seq;
+	__u32 refresh_rate;
+	__u32 blank;
+	__u32 cursor_enable;
+	__u32 cursor_x;
+	__u32 cursor_y;
+	__u32 cursor_width;
+	__u32 cursor_height;
+	__u32 guest_state;
+	__u64 cursor_seq;
+	__u64 cursor_image_seq;
+	__u64 guest_seq;
+	__u64 dropped_draws;
+};
+
+/*
+ * The cursor plane, which the guest sets through fb_cursor, e.g. fbcon's
+ * cursor, instead of drawing it into the frame. It's off until the first
+ * VGFBM_GET_CURSOR, the cursor is drawn into the frame until then, and
+ * fills in with the guest's next cursor update after it. The master
+ * composites image at x, y in virtual screen coordinates while enable is
+ * set. The image is width * height opaque pixels in the frame's pixel
+ * format, without padding. VGFBM_GET_CURSOR fills it in if image_size is
+ * large enough and sets image_size to the size needed. seq changes with
+ * any change of the cursor, image_seq only with changes of the image.
+ */
+struct vgfbm_cursor {
+	__u32 enable;
+	__u32 x;
+	__u32 y;
+	__u32 hot_x;
+	__u32 hot_y;
+	__u32 width;
+	__u32 height;
+	__u32 reserved;
+	__u64 seq;
+	__u64 image_seq;
+	__u64 image;
+	__u64 image_size;
+};
+
+/*
+ * Whether anything in the guest uses the device. It's attached while the
+ * guest has /dev/fbN open or fbcon is bound to it, which includes mappings
+ * of it, as those hold the file. An attached device is idle once nothing
+ * was drawn or damaged for the idle timeout set by VGFBM_SET_IDLE_TIMEOUT,
+ * 0 keeps it active. Drawing into a mapping doesn't count unless it's
+ * panned or damaged otherwise. seq changes with every change of state,
+ * idle_ms is the time since the last drawing.
+ */
+#define VGFBM_GUEST_DETACHED 0
+#define VGFBM_GUEST_IDLE 1
+#define VGFBM_GUEST_ACTIVE 2
+
+struct vgfbm_guest_state {
+	__u32 state;
+	__u32 users;
+	__u64 seq;
+	__u64 idle_ms;
+};
+
+/*
+ * Frame pacing. While more than max_pending frames are unacknowledged,
+ * the guest's FBIO_WAITFORVSYNC blocks until the master acknowledges a
+ * frame with VGFBM_ACK_FRAME, but at most timeout_ms. FBIOPAN_DISPLAY
+ * never blocks, it runs under the console lock. A max_pending of 0
+ * disables pacing. A guest of a master which stopped acknowledging
+ * still gets a frame through every timeout_ms, so a long timeout is what
+ * lets its frame rate drop towards zero, below the 1Hz minimum refresh
+ * rate.
+ */
+struct vgfbm_pacing {
+	__u32 max_pending;
+	__u32 timeout_ms;
+};
+
+/*
+ * Where screen memory comes from. VGFBM_ALLOC_DMA32 restricts it to 32-bit
+ * addressable pages, VGFBM_ALLOC_ANY allows any zone including highmem.
+ * A node of -1 allocates on the node the master runs on when the screen
+ * memory is set up, also for sparse pages written later by the guest.
+ * The policy applies from the next screen memory allocation on.
+ *
+ * With VGFBM_ALLOC_SPARSE set in flags, pages are only allocated once they
+ * are first written, by the guest, the master or a drawing operation.
+ * Unwritten pages read as zero.
+ */
+#define VGFBM_ALLOC_DMA32 0
+#define VGFBM_ALLOC_ANY 1
+
+#define VGFBM_ALLOC_SPARSE (1u << 0)
+
+struct vgfbm_alloc_policy {
+	__u32 policy;
+	__s32 node;
+	__u32 flags;
+	__u32 reserved;
+};
+
+/*
+ * VGFBM_TAKE_SNAPSHOT freezes the shown frame copy-on-write: pages written
+ * afterwards get copied first, so the snapshot keeps the frame as it was
+ * without blocking the guest. It replaces the previous snapshot and can be
+ * mapped read only at VGFBM_MMAP_SNAPSHOT, size bytes long. The frame
+ * starts offset bytes into the mapping, with line_length bytes per line.
+ * Mappings keep their snapshot after VGFBM_RELEASE_SNAPSHOT or the next
+ * VGFBM_TAKE_SNAPSHOT, until they're unmapped.
+ */
+struct vgfbm_snapshot {
+	__u64 frame_seq;
+	__u64 generation;
+	__u32 xres;
+	__u32 yres;
+	__u32 line_length;
+	__u32 offset;
+	__u64 size;
+};
+
+/*
+ * The framebuffer device is created by VGFBM_CREATE, or with defaults by
+ * the first operation needing it. Creating it with the final mode right
+ * away saves allocating a screen buffer which gets replaced immediately.
+ * Zero xres, yres, buffers or refresh_rate keep the defaults of 800x600,
+ * two buffers and 60Hz. alloc only applies with VGFBM_CREATE_ALLOC_POLICY
+ * set in flags, see VGFBM_SET_ALLOC_POLICY. pitch_align is as for
+ * VGFBM_SET_PITCH_ALIGN. VGFBM_CREATE fails with EBUSY once the device
+ * exists.
+ */
+#define VGFBM_CREATE_ALLOC_POLICY (1u << 0)
+
+struct vgfbm_create {
+	__u32 xres;
+	__u32 yres;
+	__u32 buffers;
+	__u32 refresh_rate;
+	__u32 flags;
+	__u32 pitch_align;
+	struct vgfbm_alloc_policy alloc;
+};
+
+/*
+ * VGFBM_READ_THUMBNAIL reads the shown frame scaled down by 1 << shift,
+ * with shift from 1 to VGFBM_THUMBNAIL_MAX_SHIFT. VGFBM_THUMBNAIL_BOX
+ * averages each block, otherwise its top left pixel is taken. buffer
+ * holds the whole thumbnail, stride bytes per line, but only the part
+ * covering area is written. area is in frame coordinates, a width of 0
+ * means the whole frame. VGFBM_THUMBNAIL_DAMAGE uses the pending damage
+ * instead and takes it like VGFBM_GET_FRAME_STATE does. On return, width
+ * and height are the size of the thumbnail and area the part of it which
+ * was written, in thumbnail pixels.
+ */
+#define VGFBM_THUMBNAIL_BOX (1u << 0)
+#define VGFBM_THUMBNAIL_DAMAGE (1u << 1)
+
+struct vgfbm_thumbnail {
+	__u32 shift;
+	__u32 flags;
+	__u32 width;
+	__u32 height;
+	struct vgfbm_damage area;
+	__u64 buffer;
+	__u64 buffer_size;
+	__u32 stride;
+	__u32 reserved;
+	__u64 frame_seq;
+};
+
+/*
+ * Frame ring. VGFBM_SET_RING sets up slots frame slots of slot_size bytes
+ * each, 0 slots remove it. A slot_size of 0 fits a whole frame of the
+ * current mode. size is set to the size of the ring, which is mapped at
+ * VGFBM_MMAP_RING with struct vgfbm_ring at the start and slot n at
+ * data_offset + n * slot_size. Once per frame interval and right after
+ * each pan, the driver copies the part of the shown frame damaged since
+ * into the slot at head % slots and advances head afterwards. The ring
+ * tracks damage on its own, leaving that of VGFBM_GET_FRAME_STATE alone,
+ * and keeps damage outside the shown frame until the next pan. A new ring starts
+ * out with everything damaged. The master advances tail
+ * once it's done with a slot. While the ring is full, damage accumulates.
+ * Damage too large for a slot is dropped and counted in dropped. poll
+ * reports the ring as readable while head differs from tail.
+ */
+struct vgfbm_ring_setup {
+	__u32 slots;
+	__u32 slot_size;
+	__u64 size;
+};
+
+struct vgfbm_ring {
+	__u32 slots;
+	__u32 slot_size;
+	__u32 data_offset;
+	__u32 reserved;
+	__u64 head;
+	__u64 tail;
+	__u64 dropped;
+};
+
+/*
+ * Start of each slot. rect is in frame coordinates, its pixels start
+ * data_offset bytes into the slot, rows stride bytes apart.
+ */
+struct vgfbm_ring_slot {
+	__u64 frame_seq;
+	__u64 generation;
+	__u32 xres;
+	__u32 yres;
+	struct vgfbm_damage rect;
+	__u32 stride;
+	__u32 data_offset;
+};
+
+/*
+ * Command log. VGFBM_SET_COMMAND_LOG with 1 makes the driver record the
+ * copies and solid fills the guest draws, 0 stops it. Each command covers
+ * rect, in virtual screen coordinates. VGFBM_COMMAND_COPY moves the
+ * pixels at sx, sy there, VGFBM_COMMAND_FILL sets them to color. Other
+ * drawing goes into the log's own damage. VGFBM_READ_COMMANDS takes up to
+ * count commands into buffer, oldest first, and sets count to the number
+ * taken. Once the log is empty, it takes the log's damage as well.
+ * Replaying the commands in order on the previous contents, and then
+ * updating the damage from the screen memory, gives the current contents.
+ * VGFBM_COMMANDS_MORE means commands are left, the damage is withheld
+ * until they're read. Commands which don't fit the log of
+ * VGFBM_MAX_COMMANDS entries are dropped, the whole log turning into
+ * damage, which VGFBM_COMMANDS_OVERFLOW reports. Starting the log and
+ * changing modes damage everything. The damage of VGFBM_GET_FRAME_STATE
+ * is separate and still covers the commands.
+ */
+#define VGFBM_COMMAND_COPY 1
+#define VGFBM_COMMAND_FILL 2
+
+struct vgfbm_command {
+	__u32 type;
+	__u32 color;
+	__u32 sx;
+	__u32 sy;
+	struct vgfbm_damage rect;
+};
+
+#define VGFBM_COMMANDS_MORE (1u << 0)
+#define VGFBM_COMMANDS_OVERFLOW (1u << 1)
+
+struct vgfbm_commands {
+	__u64 buffer;
+	__u32 count;
+	__u32 flags;
+	struct vgfbm_damage damage;
+	__u64 frame_seq;
+};
+
+/*
+ * Batched drawing for guests. VGFB_DRAW on the framebuffer device runs
+ * count operations from ops in order. Each draws to the rect at x, y of
+ * width by height pixels of the virtual screen, clipped to it.
+ * VGFB_DRAW_FILL sets it to color, VGFB_DRAW_COPY moves the pixels at
+ * sx, sy there and VGFB_DRAW_IMAGE copies them from image, rows stride
+ * bytes apart, or width * 4 if stride is 0. Pixels are 32 bit with red
+ * in bits 0-7, green in 8-15 and blue in 16-23, like the pseudo palette
+ * fbcon draws with. The whole batch is checked first and nothing is
+ * drawn if any operation is invalid. If reading an image faults or
+ * screen memory runs out, the operations before it stay drawn.
+ */
+#define VGFB_DRAW_FILL 1
+#define VGFB_DRAW_COPY 2
+#define VGFB_DRAW_IMAGE 3
+
+struct vgfb_draw_op {
+	__u32 type;
+	__u32 color;
+	__u32 x;
+	__u32 y;
+	__u32 width;
+	__u32 height;
+	__u32 sx;
+	__u32 sy;
+	__u32 stride;
+	__u32 reserved;
+	__u64 image;
+};
+
+struct vgfb_draw {
+	__u64 ops;
+	__u32 count;
+	__u32 flags;
+};
+
 #define VGFBM_GET_FB_MINOR _IOW(VG_MAGIC, 1, int*)
+#define VGFBM_READ_RECTS _IOW(VG_MAGIC, 2, struct vgfbm_rects)
+#define VGFBM_WRITE_RECTS _IOW(VG_MAGIC, 3, struct vgfbm_rects)
+#define VGFBM_GET_FRAME_STATE _IOR(VG_MAGIC, 4, struct vgfbm_frame_state)
+#define VGFBM_ACK_FRAME _IOW(VG_MAGIC, 5, __u64)
+#define VGFBM_SET_PACING _IOW(VG_MAGIC, 6, struct vgfbm_pacing)
+#define VGFBM_SET_REFRESH_RATE _IOW(VG_MAGIC, 7, __u32)
+#define VGFBM_SET_ALLOC_POLICY _IOW(VG_MAGIC, 8, struct vgfbm_alloc_policy)
+/*
+ * Packs and frees the screen memory after this many ms without the master
+ * reading it, the frame state or acking, 0 never. Blanking does it right
+ * away. Any later access restores the contents.
+ */
+#define VGFBM_SET_RECLAIM_TIMEOUT _IOW(VG_MAGIC, 9, __u32)
+#define VGFBM_GET_CURSOR _IOWR(VG_MAGIC, 10, struct vgfbm_cursor)
+#define VGFBM_TAKE_SNAPSHOT _IOR(VG_MAGIC, 11, struct vgfbm_snapshot)
+#define VGFBM_RELEASE_SNAPSHOT _IO(VG_MAGIC, 12)
+#define VGFBM_CREATE _IOW(VG_MAGIC, 13, struct vgfbm_create)
+#define VGFBM_READ_THUMBNAIL _IOWR(VG_MAGIC, 14, struct vgfbm_thumbnail)
+/*
+ * Rounds line_length up to a power of two up to VGFBM_MAX_PITCH_ALIGN,
+ * 0 packs lines. Reallocates the screen memory like a mode change.
+ */
+#define VGFBM_SET_PITCH_ALIGN _IOW(VG_MAGIC, 15, __u32)
+#define VGFBM_GET_GUEST_STATE _IOR(VG_MAGIC, 16, struct vgfbm_guest_state)
+#define VGFBM_SET_IDLE_TIMEOUT _IOW(VG_MAGIC, 17, __u32)
+#define VGFBM_SET_RING _IOWR(VG_MAGIC, 18, struct vgfbm_ring_setup)
+/*
+ * Attaches a read only /dev/vgfbmo handle to the device with the given fb
+ * minor. It gets its own damage and frame_seq, starting all damaged, and
+ * only the getters, VGFBM_READ_RECTS, VGFBM_READ_THUMBNAIL without
+ * VGFBM_THUMBNAIL_DAMAGE and read only mappings. poll reports new frames
+ * as readable, damage as priority, and hangs up with the master. It
+ * neither acks frames nor holds off reclaim.
+ */
+#define VGFBM_OBSERVE _IOW(VG_MAGIC, 19, __u32)
+#define VGFBM_SET_COMMAND_LOG _IOW(VG_MAGIC, 20, __u32)
+#define VGFBM_READ_COMMANDS _IOWR(VG_MAGIC, 21, struct vgfbm_commands)
+/*
+ * eventfd signalled once a closed master's device is torn down in the
+ * background, -1 for none. Guest mappings keep their memory until unmapped.
+ */
+#define VGFBM_SET_REMOVE_EVENT _IOW(VG_MAGIC, 22, __s32)
+
+#define VGFB_DRAW _IOW(VG_MAGIC, 64, struct vgfb_draw)
 
 #endif
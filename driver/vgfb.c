@@ -4,25 +4,30 @@
 #include <linux/mm.h>
 #include <linux/string.h>
 #include <linux/signal.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
 #include "vgfbmx.h"
+#include "vgfbmem.h"
 #include "vgfb.h"
 #include "vg.h"
 
-static void vm_open(struct vm_area_struct *vma);
-static void vm_close(struct vm_area_struct *vma);
+static int vgfb_blank(int blank, struct fb_info *info);
+static int vgfb_open(struct fb_info *info, int user);
+static int vgfb_release(struct fb_info *info, int user);
+static int vgfb_cursor(struct fb_info *info, struct fb_cursor *cursor);
 
-static const struct vm_operations_struct vm_default_ops = {
-	.open = vm_open,
-	.close = vm_close,
-};
-
-static const unsigned long initial_resolution[] = {800, 600};
+/* fbcon may draw from atomic context */
+#define VGFB_DRAW_GFP (GFP_ATOMIC | __GFP_NOWARN)
+#define VGFB_BLIT_CHUNK 64
 
 static struct fb_ops fb_default_ops = {
 	.owner = THIS_MODULE,
+	.fb_open = vgfb_open,
+	.fb_release = vgfb_release,
 	.fb_read = vgfb_read,
 	.fb_write = vgfb_write,
 	.fb_mmap = vgfb_mmap,
@@ -30,9 +35,12 @@ static struct fb_ops fb_default_ops = {
 	.fb_check_var = vgfb_check_var,
 	.fb_setcolreg = vgfb_setcolreg,
 	.fb_pan_display = vgfb_pan_display,
+	.fb_blank = vgfb_blank,
 	.fb_fillrect = vgfb_fillrect,
 	.fb_copyarea = vgfb_copyarea,
-	.fb_imageblit = sys_imageblit,
+	.fb_imageblit = vgfb_imageblit,
+	.fb_cursor = vgfb_cursor,
+	.fb_ioctl = vgfb_ioctl,
 	.fb_destroy = vgfb_fb_destroy,
 };
 
@@ -64,20 +72,11 @@ int vgfb_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
 	return 0;
 }
 
-int vgfb_set_screenbase(struct vgfbm *fb, void *memory)
+int vgfb_set_screenbase(struct vgfbm *fb, struct vm_mem_entry *entry)
 {
-	struct vm_mem_entry *entry;
-
-	if (memory) {
-		entry = kzalloc(sizeof(struct vgfbm), GFP_KERNEL);
-		if (!entry)
-			return -ENOMEM;
-		entry->fb = fb;
-		entry->memory = memory;
-		mutex_init(&entry->lock);
+	if (entry) {
 		if (!vgfb_acquire_screen_memory(entry)) {
 			pr_err("vgfb: vgfb_acquire_screen_memory failed\n");
-			kfree(entry);
 			return -EAGAIN;
 		}
 		if (fb->last_mem_entry) {
@@ -85,13 +84,36 @@ int vgfb_set_screenbase(struct vgfbm *fb, void *memory)
 			fb->last_mem_entry = 0;
 		}
 		fb->last_mem_entry = entry;
-		fb->info->screen_base = memory;
 	} else {
 		if (fb->last_mem_entry) {
 			vgfb_release_screen_memory(fb->last_mem_entry);
 			fb->last_mem_entry = 0;
 		}
-		fb->info->screen_base = 0;
+	}
+	return 0;
+}
+
+/*
+ * Replaces the screen memory with size bytes allocated according to the
+ * device's allocation policy. The pages come from the node of the master,
+ * which resizes the screen, unless it picked one.
+ */
+int vgfb_realloc_screen(struct vgfbm *fb, size_t size)
+{
+	int ret;
+	struct vm_mem_entry *entry;
+
+	entry = vgfb_mem_alloc(fb, size);
+	if (!entry) {
+		pr_info("vgfb: vgfb_mem_alloc failed\n");
+		return -ENOMEM;
+	}
+	pr_debug("vgfb: allocated screen memory %p\n", entry);
+
+	ret = vgfb_set_screenbase(fb, entry);
+	if (ret < 0) {
+		vgfb_mem_free(entry);
+		return ret;
 	}
 	return 0;
 }
@@ -112,12 +134,346 @@ int vgfb_setcolreg(u_int regno, u_int r, u_int g, u_int b,
 	return 0;
 }
 
+/* Publishes the current state in the status page, needs fb->state_lock */
+void vgfb_status_write(struct vgfbm *fb, const struct fb_info *info)
+{
+	struct vgfbm_status *s = fb->status;
+	const struct vgfb_damage *d = &fb->damage;
+
+	if (!s)
+		return;
+
+	WRITE_ONCE(s->seq, s->seq + 1);
+	smp_wmb();
+	s->xres = info->var.xres;
+	s->yres = info->var.yres;
+	s->xres_virtual = info->var.xres_virtual;
+	s->yres_virtual = info->var.yres_virtual;
+	s->line_length = info->fix.line_length;
+	s->xoffset = info->var.xoffset;
+	s->yoffset = info->var.yoffset;
+	s->frame_seq = fb->frame_seq;
+	s->vblank_seq = fb->vblank_seq;
+	s->damage_seq = fb->damage_seq;
+	s->generation = fb->generation;
+	s->acked_seq = fb->acked_seq;
+	s->refresh_rate = fb->refresh_rate;
+	s->blank = max(fb->guest_blank, fb->master_blank);
+	s->cursor_enable = fb->cursor.enable;
+	s->cursor_x = fb->cursor.x;
+	s->cursor_y = fb->cursor.y;
+	s->cursor_width = fb->cursor.width;
+	s->cursor_height = fb->cursor.height;
+	s->cursor_seq = fb->cursor.seq;
+	s->cursor_image_seq = fb->cursor.image_seq;
+	s->guest_state = fb->guest_state;
+	s->guest_seq = fb->guest_seq;
+	s->dropped_draws = fb->dropped_draws;
+	if (d->x1 < d->x2 && d->y1 < d->y2)
+		s->damage = (struct vgfbm_damage){ d->x1, d->y1,
+			d->x2 - d->x1, d->y2 - d->y1 };
+	else
+		s->damage = (struct vgfbm_damage){ 0 };
+	smp_wmb();
+	WRITE_ONCE(s->seq, s->seq + 1);
+}
+
+/*
+ * Publishes changes of the guest's state, returns whether there was one.
+ * Needs fb->state_lock.
+ */
+static bool vgfb_guest_update(struct vgfbm *fb)
+{
+	u32 state;
+
+	if (!fb->guest_users)
+		state = VGFBM_GUEST_DETACHED;
+	else if (fb->guest_active)
+		state = VGFBM_GUEST_ACTIVE;
+	else
+		state = VGFBM_GUEST_IDLE;
+	if (state == fb->guest_state)
+		return false;
+	fb->guest_state = state;
+	fb->guest_seq++;
+	return true;
+}
+
+/* Jiffies per frame at the refresh rate, needs fb->state_lock */
+static unsigned long vgfb_frame_jiffies(const struct vgfbm *fb)
+{
+	return max_t(unsigned long, HZ / fb->refresh_rate, 1);
+}
+
+/* Whether the guest or the master blanked the device, needs fb->state_lock */
+static bool vgfb_blank_state(const struct vgfbm *fb)
+{
+	return fb->guest_blank != FB_BLANK_UNBLANK
+	    || fb->master_blank != FB_BLANK_UNBLANK;
+}
+
+static bool vgfb_blanked(struct vgfbm *fb)
+{
+	bool ret;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fb->state_lock, flags);
+	ret = vgfb_blank_state(fb);
+	spin_unlock_irqrestore(&fb->state_lock, flags);
+	return ret;
+}
+
+/* Grows d to cover the rectangle */
+static void vgfb_damage_merge(struct vgfb_damage *d, u32 x, u32 y,
+		u32 width, u32 height)
+{
+	if (d->x1 >= d->x2 || d->y1 >= d->y2) {
+		d->x1 = x;
+		d->y1 = y;
+		d->x2 = x + width;
+		d->y2 = y + height;
+	} else {
+		d->x1 = min(d->x1, x);
+		d->y1 = min(d->y1, y);
+		d->x2 = max(d->x2, x + width);
+		d->y2 = max(d->y2, y + height);
+	}
+}
+
+/* Damages the whole virtual screen for everyone, needs fb->state_lock */
+void vgfb_damage_all(struct vgfbm *fb, const struct fb_info *info)
+{
+	struct vgfbm_observer *obs;
+	struct vgfb_damage all = { 0, 0, info->var.xres_virtual,
+				   info->var.yres_virtual };
+
+	fb->damage = all;
+	fb->ring_damage = all;
+	fb->ring_pending = (struct vgfb_damage){ 0 };
+	list_for_each_entry(obs, &fb->observers, list)
+		obs->damage = all;
+	vgfb_command_log_reset(fb, info);
+	fb->damage_seq++;
+}
+
+/* Drops the logged commands and damages everything, needs fb->state_lock */
+void vgfb_command_log_reset(struct vgfbm *fb, const struct fb_info *info)
+{
+	struct vgfb_command_log *log = &fb->command_log;
+
+	log->head = 0;
+	log->count = 0;
+	log->bounds = (struct vgfb_damage){ 0 };
+	log->damage = (struct vgfb_damage){ 0, 0, info->var.xres_virtual,
+					    info->var.yres_virtual };
+}
+
+/*
+ * Logs a copy or fill of the given rect, or just damages it if cmd is NULL.
+ * Needs fb->state_lock.
+ */
+static void vgfb_command_log_add(struct vgfb_command_log *log, u32 x, u32 y,
+		u32 width, u32 height, const struct vgfbm_command *cmd)
+{
+	u32 x1, y1, x2, y2;
+	struct vgfbm_command *c;
+	struct vgfb_damage *d = &log->damage;
+
+	if (!cmd) {
+		vgfb_damage_merge(d, x, y, width, height);
+		return;
+	}
+
+	if (log->count == VGFBM_MAX_COMMANDS) {
+		/* Redraw everything the dropped commands would have drawn */
+		vgfb_damage_merge(d, log->bounds.x1, log->bounds.y1,
+				  log->bounds.x2 - log->bounds.x1,
+				  log->bounds.y2 - log->bounds.y1);
+		vgfb_damage_merge(d, x, y, width, height);
+		log->head = 0;
+		log->count = 0;
+		log->bounds = (struct vgfb_damage){ 0 };
+		log->overflow = true;
+		return;
+	}
+
+	/* Pending damage in the source moves along with the pixels */
+	if (cmd->type == VGFBM_COMMAND_COPY && d->x1 < d->x2 && d->y1 < d->y2) {
+		x1 = max(d->x1, cmd->sx);
+		y1 = max(d->y1, cmd->sy);
+		x2 = min(d->x2, cmd->sx + width);
+		y2 = min(d->y2, cmd->sy + height);
+		if (x1 < x2 && y1 < y2)
+			vgfb_damage_merge(d, x1 - cmd->sx + x, y1 - cmd->sy + y,
+					  x2 - x1, y2 - y1);
+	}
+
+	c = &log->commands[(log->head + log->count++) % VGFBM_MAX_COMMANDS];
+	*c = *cmd;
+	c->rect = (struct vgfbm_damage){ x, y, width, height };
+	vgfb_damage_merge(&log->bounds, x, y, width, height);
+}
+
+/*
+ * Damages the rects of count commands under one lock, logging the copies
+ * and fills among them. Commands of type 0 only damage.
+ */
+static void vgfb_damage_add_commands(struct fb_info *info,
+		const struct vgfbm_command *cmds, u32 count)
+{
+	u32 i, x, y, width, height;
+	bool changed = false, damaged = false;
+	unsigned long flags;
+	struct vgfbm_observer *obs;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	spin_lock_irqsave(&fb->state_lock, flags);
+	fb->last_drawn = jiffies;
+	if (!fb->guest_active) {
+		fb->guest_active = true;
+		if (fb->idle_timeout_ms)
+			schedule_delayed_work(&fb->idle_work,
+				msecs_to_jiffies(fb->idle_timeout_ms));
+		changed = vgfb_guest_update(fb);
+		if (changed)
+			vgfb_status_write(fb, info);
+	}
+	/* Nobody looks at a blanked device, unblanking damages everything */
+	if (vgfb_blank_state(fb)) {
+		spin_unlock_irqrestore(&fb->state_lock, flags);
+		if (changed)
+			wake_up(&fb->wait);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		x = cmds[i].rect.x;
+		y = cmds[i].rect.y;
+		width = cmds[i].rect.width;
+		height = cmds[i].rect.height;
+		if (x >= info->var.xres_virtual || y >= info->var.yres_virtual)
+			continue;
+		if (!width || !height)
+			continue;
+		if (width > info->var.xres_virtual - x)
+			width = info->var.xres_virtual - x;
+		if (height > info->var.yres_virtual - y)
+			height = info->var.yres_virtual - y;
+		vgfb_damage_merge(&fb->damage, x, y, width, height);
+		if (fb->ring)
+			vgfb_damage_merge(&fb->ring_damage, x, y, width,
+					  height);
+		list_for_each_entry(obs, &fb->observers, list)
+			vgfb_damage_merge(&obs->damage, x, y, width, height);
+		if (fb->command_log.enable)
+			vgfb_command_log_add(&fb->command_log, x, y, width,
+					     height,
+					     cmds[i].type ? &cmds[i] : NULL);
+		damaged = true;
+	}
+	if (damaged) {
+		fb->damage_seq++;
+		vgfb_status_write(fb, info);
+		/* The ring gets the damage of a whole frame interval at once */
+		if (fb->ring)
+			schedule_delayed_work(&fb->ring_work,
+					      vgfb_frame_jiffies(fb));
+	}
+	spin_unlock_irqrestore(&fb->state_lock, flags);
+	if (damaged || changed)
+		wake_up(&fb->wait);
+}
+
+void vgfb_damage_add(struct fb_info *info, u32 x, u32 y, u32 width,
+		u32 height)
+{
+	struct vgfbm_command cmd = { 0 };
+
+	cmd.rect = (struct vgfbm_damage){ x, y, width, height };
+	vgfb_damage_add_commands(info, &cmd, 1);
+}
+
+/* fbcon passes palette indices for truecolor visuals */
+static u32 vgfb_color(struct fb_info *info, u32 color)
+{
+	if (color < 256)
+		return ((u32 *)info->pseudo_palette)[color];
+	return color;
+}
+
+/* Both return false if screen memory for some pixels couldn't be had */
+static bool vgfb_fill(struct fb_info *info, struct vm_mem_entry *e,
+		const struct vgfbm_damage *r, u32 color, bool xor, gfp_t gfp)
+{
+	u32 h = r->height;
+	bool ret = true;
+	unsigned long line_length = info->fix.line_length;
+	unsigned long offset = r->y * line_length + r->x * 4;
+
+	while (h--) {
+		if (!vgfb_mem_fill(e, offset, color, r->width, xor, gfp))
+			ret = false;
+		offset += line_length;
+	}
+	return ret;
+}
+
+static bool vgfb_move(struct fb_info *info, struct vm_mem_entry *e,
+		const struct vgfbm_damage *r, u32 sx, u32 sy, gfp_t gfp)
+{
+	u32 h = r->height;
+	bool ret = true;
+	unsigned long line_length = info->fix.line_length;
+	unsigned long src = sy * line_length + sx * 4;
+	unsigned long dst = r->y * line_length + r->x * 4;
+
+	/* Go bottom up when moving down so no row is overwritten unread */
+	if (dst > src) {
+		src += (h - 1) * line_length;
+		dst += (h - 1) * line_length;
+		while (h--) {
+			if (!vgfb_mem_move(e, dst, src, r->width * 4, gfp))
+				ret = false;
+			src -= line_length;
+			dst -= line_length;
+		}
+	} else {
+		while (h--) {
+			if (!vgfb_mem_move(e, dst, src, r->width * 4, gfp))
+				ret = false;
+			src += line_length;
+			dst += line_length;
+		}
+	}
+	return ret;
+}
+
+/*
+ * fbcon can't wait for memory, so its draws lose the pixels on pages that
+ * couldn't be allocated atomically. Counts that in the status page.
+ */
+static void vgfb_draw_dropped(struct fb_info *info)
+{
+	unsigned long flags;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	pr_warn_ratelimited("vgfb: console draw dropped, out of memory\n");
+	spin_lock_irqsave(&fb->state_lock, flags);
+	fb->dropped_draws++;
+	vgfb_status_write(fb, info);
+	spin_unlock_irqrestore(&fb->state_lock, flags);
+}
+
 void vgfb_fillrect(struct fb_info *info, const struct fb_fillrect *r)
 {
-	u32 *mem;
-	u32 i, w, h, d;
+	u32 w, h, color;
+	struct vgfbm_command cmd = { 0 };
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+	struct vm_mem_entry *e = READ_ONCE(fb->last_mem_entry);
 
-	if (info->state != FBINFO_STATE_RUNNING)
+	if (info->state != FBINFO_STATE_RUNNING || !e)
+		return;
+
+	if (r->rop != ROP_COPY && r->rop != ROP_XOR)
 		return;
 
 	h = r->height;
@@ -135,37 +491,28 @@ void vgfb_fillrect(struct fb_info *info, const struct fb_fillrect *r)
 	if (h > info->var.yres_virtual - r->dy)
 		h = info->var.yres_virtual - r->dy;
 
-	d = info->var.xres_virtual - w;
-	mem = (u32 *)info->screen_base
-		+ (r->dy * info->var.xres_virtual + r->dx);
-
-	switch (r->rop) {
-	case ROP_COPY:
-		while (h--) {
-			i = w;
-			while (i--)
-				(*mem++) = r->color;
-			mem += d;
-		}
-		break;
-	case ROP_XOR:
-		while (h--) {
-			i = w;
-			while (i--)
-				(*mem++) ^= r->color;
-			mem += d;
-		}
-		break;
+	color = vgfb_color(info, r->color);
+	cmd.rect = (struct vgfbm_damage){ r->dx, r->dy, w, h };
+	if (r->rop == ROP_COPY) {
+		cmd.type = VGFBM_COMMAND_FILL;
+		cmd.color = color;
 	}
 
+	if (!vgfb_fill(info, e, &cmd.rect, color, r->rop == ROP_XOR,
+		       VGFB_DRAW_GFP))
+		vgfb_draw_dropped(info);
+	/* Only once drawn, fbcon doesn't hold fb->lock against the master */
+	vgfb_damage_add_commands(info, &cmd, 1);
 }
 
 void vgfb_copyarea(struct fb_info *info, const struct fb_copyarea *r)
 {
-	u32 *src, *dst;
-	u32 w, h, d;
+	u32 w, h;
+	struct vgfbm_command cmd = { 0 };
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+	struct vm_mem_entry *e = READ_ONCE(fb->last_mem_entry);
 
-	if (info->state != FBINFO_STATE_RUNNING)
+	if (info->state != FBINFO_STATE_RUNNING || !e)
 		return;
 
 	h = r->height;
@@ -177,6 +524,9 @@ void vgfb_copyarea(struct fb_info *info, const struct fb_copyarea *r)
 	if (r->dx >= info->var.xres_virtual || r->dy >= info->var.yres_virtual)
 		return;
 
+	if (r->sx >= info->var.xres_virtual || r->sy >= info->var.yres_virtual)
+		return;
+
 	if (w > info->var.xres_virtual - r->dx)
 		w = info->var.xres_virtual - r->dx;
 
@@ -189,18 +539,160 @@ void vgfb_copyarea(struct fb_info *info, const struct fb_copyarea *r)
 	if (h > info->var.yres_virtual - r->sy)
 		h = info->var.yres_virtual - r->sy;
 
-	d = info->var.xres_virtual - w;
-	src = (u32 *)info->screen_base
-		+ (r->sy * info->var.xres_virtual + r->sx);
-	dst = (u32 *)info->screen_base
-		+ (r->dy * info->var.xres_virtual + r->dx);
+	cmd.type = VGFBM_COMMAND_COPY;
+	cmd.sx = r->sx;
+	cmd.sy = r->sy;
+	cmd.rect = (struct vgfbm_damage){ r->dx, r->dy, w, h };
 
-	while (h--) {
-		memmove(dst, src, w*4);
-		src += d;
-		dst += d;
+	if (!vgfb_move(info, e, &cmd.rect, r->sx, r->sy, VGFB_DRAW_GFP))
+		vgfb_draw_dropped(info);
+	vgfb_damage_add_commands(info, &cmd, 1);
+}
+
+void vgfb_imageblit(struct fb_info *info, const struct fb_image *image)
+{
+	u32 buf[VGFB_BLIT_CHUNK];
+	u32 w, h, x, y, n, i, fg = 0, bg = 0, pitch;
+	bool dropped = false;
+	const u8 *src;
+	unsigned long offset;
+	unsigned long line_length = info->fix.line_length;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+	struct vm_mem_entry *e = READ_ONCE(fb->last_mem_entry);
+
+	if (info->state != FBINFO_STATE_RUNNING || !e)
+		return;
+
+	h = image->height;
+	w = image->width;
+
+	if (!w || !h)
+		return;
+
+	if (image->dx >= info->var.xres_virtual
+	 || image->dy >= info->var.yres_virtual)
+		return;
+
+	switch (image->depth) {
+	case 1:
+		fg = vgfb_color(info, image->fg_color);
+		bg = vgfb_color(info, image->bg_color);
+		pitch = (w + 7) / 8;
+		break;
+	case 8:
+		pitch = w;
+		break;
+	default:
+		return;
+	}
+
+	if (w > info->var.xres_virtual - image->dx)
+		w = info->var.xres_virtual - image->dx;
+
+	if (h > info->var.yres_virtual - image->dy)
+		h = info->var.yres_virtual - image->dy;
+
+	offset = image->dy * line_length + image->dx * 4;
+	for (y = 0; y < h; y++) {
+		src = (const u8 *)image->data + y * pitch;
+		for (x = 0; x < w; x += n) {
+			n = min_t(u32, w - x, VGFB_BLIT_CHUNK);
+			for (i = 0; i < n; i++) {
+				if (image->depth == 1)
+					buf[i] = src[(x + i) / 8]
+						& (0x80 >> ((x + i) % 8))
+						? fg : bg;
+				else
+					buf[i] = vgfb_color(info, src[x + i]);
+			}
+			if (vgfb_mem_write(e, offset + x * 4, buf, n * 4,
+					   VGFB_DRAW_GFP) != n * 4)
+				dropped = true;
+		}
+		offset += line_length;
 	}
 
+	if (dropped)
+		vgfb_draw_dropped(info);
+	vgfb_damage_add(info, image->dx, image->dy, w, h);
+}
+
+/*
+ * Keeps the cursor in its own plane for the master to composite, instead
+ * of drawing it into the frame. The image is what soft_cursor would draw.
+ * Failing makes fbcon fall back to soft_cursor, which is what happens
+ * until the master enables the plane, and once more to erase a cursor
+ * it drew before that.
+ */
+static int vgfb_cursor(struct fb_info *info, struct fb_cursor *cursor)
+{
+	u32 x, y, fg, bg, pitch, pixel;
+	u8 bits;
+	bool changed = false, image_changed = false;
+	unsigned long flags;
+	const struct fb_image *image = &cursor->image;
+	const u8 *data = (const u8 *)image->data;
+	const u8 *mask = (const u8 *)cursor->mask;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+	struct vgfb_cursor *c = &fb->cursor;
+
+	if (image->width > VGFBM_CURSOR_MAX || image->height > VGFBM_CURSOR_MAX)
+		return -EINVAL;
+	if (cursor->enable && (!data || !mask || image->depth != 1))
+		return -EINVAL;
+
+	fg = vgfb_color(info, image->fg_color);
+	bg = vgfb_color(info, image->bg_color);
+	pitch = (image->width + 7) / 8;
+
+	spin_lock_irqsave(&fb->state_lock, flags);
+	if (!c->plane || (c->soft && !cursor->enable)) {
+		c->soft = cursor->enable;
+		spin_unlock_irqrestore(&fb->state_lock, flags);
+		return -EOPNOTSUPP;
+	}
+	if (c->enable != !!cursor->enable || c->x != image->dx
+	 || c->y != image->dy || c->hot_x != cursor->hot.x
+	 || c->hot_y != cursor->hot.y)
+		changed = true;
+	c->enable = cursor->enable;
+	c->x = image->dx;
+	c->y = image->dy;
+	c->hot_x = cursor->hot.x;
+	c->hot_y = cursor->hot.y;
+	/* A disabled cursor keeps its last image, the master hides it */
+	if (cursor->enable) {
+		if (c->width != image->width || c->height != image->height)
+			image_changed = true;
+		c->width = image->width;
+		c->height = image->height;
+		for (y = 0; y < image->height; y++) {
+			for (x = 0; x < image->width; x++) {
+				bits = data[y * pitch + x / 8];
+				if (cursor->rop == ROP_XOR)
+					bits ^= mask[y * pitch + x / 8];
+				else
+					bits &= mask[y * pitch + x / 8];
+				pixel = bits & (0x80 >> (x % 8)) ? fg : bg;
+				if (c->image[y * c->width + x] != pixel) {
+					c->image[y * c->width + x] = pixel;
+					image_changed = true;
+				}
+			}
+		}
+	}
+	if (image_changed) {
+		c->image_seq++;
+		changed = true;
+	}
+	if (changed) {
+		c->seq++;
+		vgfb_status_write(fb, info);
+	}
+	spin_unlock_irqrestore(&fb->state_lock, flags);
+	if (changed)
+		wake_up(&fb->wait);
+	return 0;
 }
 
 static const struct fb_fix_screeninfo fix_screeninfo_defaults = {
@@ -249,6 +741,12 @@ failed:
 void vgfb_remove(struct vgfbm *fb)
 {
 	platform_device_unregister(fb->pdev);
+	cancel_delayed_work_sync(&fb->reclaim_work);
+	cancel_delayed_work_sync(&fb->idle_work);
+	cancel_delayed_work_sync(&fb->ring_work);
+	vgfb_ring_release(fb);
+	/* The snapshot holds the device, mappings of it have their own ref */
+	vgfb_snapshot_release(fb);
 	vgfbm_release(fb);
 }
 
@@ -265,8 +763,8 @@ static int probe(struct platform_device *dev)
 	if (!fb)
 		return -EINVAL;
 
-	mutex_lock(&fb->lock);
 	mutex_lock(&fb->info_lock);
+	mutex_lock(&fb->lock);
 	if (!vgfbm_acquire(fb)) {
 		pr_err("vgfb: vgfbm_acquire failed\n");
 		ret = -EAGAIN;
@@ -294,30 +792,33 @@ static int probe(struct platform_device *dev)
 	fb->info->mode = &fb->videomode;
 	fb->info->fbops = &fb_default_ops;
 	fb->info->pseudo_palette = fb->colormap;
-	ret = vgfbm_set_resolution(fb->info, initial_resolution);
+	ret = vgfbm_set_resolution(fb->info, fb->initial_resolution);
 	if (ret < 0) {
 		pr_err("vgfb: vgfb_set_resolution failed\n");
 		goto failed_after_framebuffer_alloc;
 	}
-	fb->info->var.xres = initial_resolution[0];
-	fb->info->var.yres = initial_resolution[1];
+	fb->info->var.xres = fb->initial_resolution[0];
+	fb->info->var.yres = fb->initial_resolution[1];
 	ret = fb_alloc_cmap(&fb->info->cmap, 256, 0);
 	if (ret < 0) {
 		pr_err("vgfb: fb_alloc_cmap failed (%d)\n", ret);
 		goto failed_after_framebuffer_alloc;
 	}
+	/* fbcon may bind right away, which takes fb->lock */
+	mutex_unlock(&fb->lock);
 	ret = register_framebuffer(fb->info);
 	if (ret < 0) {
 		pr_err("vgfb: register_framebuffer failed (%d)\n", ret);
 		goto failed_after_alloc_cmap;
 	}
 	mutex_unlock(&fb->info_lock);
-	mutex_unlock(&fb->lock);
 	return 0;
 
 failed_after_alloc_cmap:
+	mutex_lock(&fb->lock);
 	fb_dealloc_cmap(&fb->info->cmap);
 failed_after_framebuffer_alloc:
+	vgfb_set_screenbase(fb, 0);
 	framebuffer_release(fb->info);
 	fb->info = 0;
 failed_after_acquire:
@@ -336,28 +837,50 @@ static int remove(struct platform_device *dev)
 {
 	struct vgfbm *fb = platform_get_drvdata(dev);
 
-	mutex_lock(&fb->lock);
-	mutex_lock(&fb->info_lock);
 	if (!fb)
 		return 0;
+	mutex_lock(&fb->info_lock);
 	if (fb->info) {
-		vgfb_set_screenbase(fb, 0);
+		mutex_lock(&fb->lock);
 		fb->info->state = FBINFO_STATE_SUSPENDED;
+		mutex_unlock(&fb->lock);
 		fb_dealloc_cmap(&fb->info->cmap);
+		/* fbcon unbinds through vgfb_release, which takes fb->lock */
 		unregister_framebuffer(fb->info);
 		fb->info = 0;
+		mutex_lock(&fb->lock);
+		vgfb_set_screenbase(fb, 0);
+		mutex_unlock(&fb->lock);
 	}
 	mutex_unlock(&fb->info_lock);
-	mutex_unlock(&fb->lock);
 	vgfbm_release(fb);
 
 	return 0;
 }
 
-ssize_t vgfb_read(struct fb_info *info, char __user *buf, size_t count,
-		loff_t *ppos)
+static void vgfb_damage_lines(struct fb_info *info, unsigned long offset,
+		size_t count)
+{
+	unsigned long first, last;
+	unsigned long line_length = info->fix.line_length;
+
+	if (!count || !line_length)
+		return;
+	first = offset / line_length;
+	last = (offset + count - 1) / line_length;
+	vgfb_damage_add(info, 0, first, info->var.xres_virtual,
+			last - first + 1);
+}
+
+/*
+ * A readv/writev still covers a single contiguous range of the screen
+ * memory, VGFBM_READ_RECTS and VGFBM_WRITE_RECTS take several rects.
+ */
+static ssize_t vgfb_io(struct fb_info *info, struct iov_iter *iter,
+		loff_t *ppos, bool write)
 {
 	ssize_t ret;
+	size_t count = iov_iter_count(iter);
 	unsigned long offset = *ppos;
 	unsigned long mem_len = info->fix.smem_len;
 	struct vgfbm *fb = *(struct vgfbm **)info->par;
@@ -367,7 +890,7 @@ ssize_t vgfb_read(struct fb_info *info, char __user *buf, size_t count,
 		ret = -EPERM;
 		goto end;
 	}
-	if (offset > mem_len || !info->screen_base) {
+	if (offset > mem_len || !fb->last_mem_entry) {
 		ret = -ENOMEM;
 		goto end;
 	}
@@ -381,24 +904,91 @@ ssize_t vgfb_read(struct fb_info *info, char __user *buf, size_t count,
 		ret = -ENOMEM;
 		goto end;
 	}
-	if (copy_to_user(buf, info->screen_base + offset, count)) {
+	if (write)
+		ret = vgfb_mem_from_iter(fb->last_mem_entry, offset, count,
+				iter);
+	else
+		ret = vgfb_mem_to_iter(fb->last_mem_entry, offset, count, iter);
+	if (!ret) {
 		ret = -EFAULT;
 		goto end;
 	}
-	*ppos += count;
-	ret = count;
+	if (write)
+		vgfb_damage_lines(info, offset, ret);
+	*ppos += ret;
 
 end:
 	mutex_unlock(&fb->lock);
 	return ret;
 }
 
+ssize_t vgfb_read(struct fb_info *info, char __user *buf, size_t count,
+		loff_t *ppos)
+{
+	int ret;
+	struct iovec iov;
+	struct iov_iter iter;
+
+	ret = import_single_range(READ, buf, count, &iov, &iter);
+	if (ret < 0)
+		return ret;
+	return vgfb_io(info, &iter, ppos, false);
+}
+
 ssize_t vgfb_write(struct fb_info *info, const char __user *buf, size_t count,
 		loff_t *ppos)
 {
-	ssize_t ret = 0;
-	unsigned long offset = *ppos;
-	unsigned long mem_len = info->fix.smem_len;
+	int ret;
+	struct iovec iov;
+	struct iov_iter iter;
+
+	ret = import_single_range(WRITE, (char __user *)buf, count, &iov,
+			&iter);
+	if (ret < 0)
+		return ret;
+	return vgfb_io(info, &iter, ppos, true);
+}
+
+ssize_t vgfb_read_iter(struct fb_info *info, struct kiocb *iocb,
+		struct iov_iter *to)
+{
+	return vgfb_io(info, to, &iocb->ki_pos, false);
+}
+
+ssize_t vgfb_write_iter(struct fb_info *info, struct kiocb *iocb,
+		struct iov_iter *from)
+{
+	return vgfb_io(info, from, &iocb->ki_pos, true);
+}
+
+static bool vgfb_rect_valid(struct fb_info *info,
+		const struct vgfbm_rect *r, u64 size, u32 stride)
+{
+	u64 row = (u64)r->width * 4;
+
+	if (!r->width || !r->height)
+		return false;
+	if (r->x >= info->var.xres_virtual || r->y >= info->var.yres_virtual)
+		return false;
+	if (r->width > info->var.xres_virtual - r->x
+	 || r->height > info->var.yres_virtual - r->y)
+		return false;
+	if (r->height > 1 && row > stride)
+		return false;
+	if (r->offset > size
+	 || (u64)(r->height - 1) * stride + row > size - r->offset)
+		return false;
+	return true;
+}
+
+int vgfb_rects_io(struct fb_info *info, const struct vgfbm_rect *rects,
+		u32 count, char __user *buf, u64 size, u32 stride, bool write)
+{
+	int ret = 0;
+	u32 i, h, row;
+	unsigned long mem;
+	char __user *ubuf;
+	unsigned long line_length = info->fix.line_length;
 	struct vgfbm *fb = *(struct vgfbm **)info->par;
 
 	mutex_lock(&fb->lock);
@@ -406,132 +996,529 @@ ssize_t vgfb_write(struct fb_info *info, const char __user *buf, size_t count,
 		ret = -EPERM;
 		goto end;
 	}
-	if (offset > mem_len || !info->screen_base) {
+	if (!fb->last_mem_entry) {
 		ret = -ENOMEM;
 		goto end;
 	}
-	if (!count) {
-		ret = 0;
-		goto end;
-	}
-	if (count > mem_len - offset)
-		count = mem_len - offset;
-	if (!count) {
-		ret = -ENOMEM;
-		goto end;
+	for (i = 0; i < count; i++) {
+		if (!vgfb_rect_valid(info, &rects[i], size, stride)) {
+			ret = -EINVAL;
+			goto end;
+		}
 	}
-	if (copy_from_user(info->screen_base + offset, buf, count)) {
-		ret = -EFAULT;
-		goto end;
+	for (i = 0; i < count; i++) {
+		const struct vgfbm_rect *r = &rects[i];
+
+		mem = r->y * line_length + r->x * 4;
+		ubuf = buf + r->offset;
+		row = r->width * 4;
+		h = r->height;
+		/* Whole lines with matching pitch are one contiguous run */
+		if (row == line_length && stride == line_length) {
+			row *= h;
+			h = 1;
+		}
+		while (h--) {
+			ret = write
+			    ? vgfb_mem_from_user(fb->last_mem_entry, mem,
+						 ubuf, row)
+			    : vgfb_mem_to_user(fb->last_mem_entry, mem,
+					       ubuf, row);
+			if (ret)
+				goto end;
+			mem += line_length;
+			ubuf += stride;
+		}
+		if (write)
+			vgfb_damage_add(info, r->x, r->y, r->width, r->height);
 	}
-	*ppos += count;
-	ret = count;
 
 end:
 	mutex_unlock(&fb->lock);
 	return ret;
 }
 
-static void vm_open(struct vm_area_struct *vma)
+/* Freezes the shown frame, needs the locks vgfb_lock takes */
+int vgfb_snapshot(struct fb_info *info, struct vgfbm_snapshot *snap)
 {
-	struct vm_mem_entry *entry = vma->vm_private_data;
+	unsigned long start, end;
+	struct vgfb_snapshot *s, *old;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
 
-	pr_debug("vgfb: %s\n", __func__);
-	if (!vgfb_acquire_screen_memory(entry))
-		panic("vgfb: vgfb_acquire_screen_memory failed");
+	if (info->state != FBINFO_STATE_RUNNING)
+		return -EPERM;
+	if (!fb->last_mem_entry)
+		return -ENOMEM;
+	start = info->var.yoffset * info->fix.line_length;
+	end = start + info->var.yres * info->fix.line_length;
+	s = vgfb_mem_snapshot(fb->last_mem_entry, start >> PAGE_SHIFT,
+			      PAGE_ALIGN(end) >> PAGE_SHIFT);
+	if (!s)
+		return -ENOMEM;
+	old = fb->snapshot;
+	fb->snapshot = s;
+
+	memset(snap, 0, sizeof(*snap));
+	spin_lock_irq(&fb->state_lock);
+	snap->frame_seq = fb->frame_seq;
+	snap->generation = fb->generation;
+	spin_unlock_irq(&fb->state_lock);
+	snap->xres = info->var.xres;
+	snap->yres = info->var.yres;
+	snap->line_length = info->fix.line_length;
+	snap->offset = start & ~PAGE_MASK;
+	snap->size = s->npages << PAGE_SHIFT;
+
+	if (old)
+		vgfb_snapshot_put(old);
+	return 0;
 }
 
-static void vm_close(struct vm_area_struct *vma)
+/*
+ * fbcon draws holding just the console lock, so replacing, freezing or
+ * panning the frame under it needs that lock too. It's global though,
+ * devices fbcon isn't bound to get away with fb->lock. fbcon binds and
+ * unbinds through vgfb_open and vgfb_release under fb->lock, so the
+ * binding can't change while that's held. Returns with the console lock
+ * if *console is set, lock_fb_info if info is given, and fb->lock held.
+ */
+bool vgfb_lock(struct vgfbm *fb, struct fb_info *info, bool *console)
 {
-	struct vm_mem_entry *entry = vma->vm_private_data;
+	*console = READ_ONCE(fb->fbcon_count);
+	for (;;) {
+		if (*console)
+			console_lock();
+		if (info && !lock_fb_info(info)) {
+			if (*console)
+				console_unlock();
+			return false;
+		}
+		mutex_lock(&fb->lock);
+		if (*console || !fb->fbcon_count)
+			return true;
+		/* fbcon got bound meanwhile, the console lock comes first */
+		mutex_unlock(&fb->lock);
+		if (info)
+			unlock_fb_info(info);
+		*console = true;
+	}
+}
 
-	pr_debug("vgfb: %s\n", __func__);
-	vgfb_release_screen_memory(entry);
+void vgfb_unlock(struct vgfbm *fb, struct fb_info *info, bool console)
+{
+	mutex_unlock(&fb->lock);
+	if (info)
+		unlock_fb_info(info);
+	if (console)
+		console_unlock();
 }
 
-bool vgfb_acquire_screen_memory(struct vm_mem_entry *e)
+/* fbcon opens with user 0, see vgfb_lock */
+static int vgfb_open(struct fb_info *info, int user)
 {
-	unsigned long val;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
 
-	mutex_lock(&e->lock);
-	val = e->count + 1;
-	if (val == 1)
-		vgfbm_acquire(e->fb);
-	if (!val) {
-		mutex_unlock(&e->lock);
-		return false;
+	mutex_lock(&fb->lock);
+	if (!user)
+		fb->fbcon_count++;
+	spin_lock_irq(&fb->state_lock);
+	/* Attaching counts as drawing, so the device starts out active */
+	fb->guest_users++;
+	fb->guest_active = true;
+	fb->last_drawn = jiffies;
+	if (fb->idle_timeout_ms)
+		schedule_delayed_work(&fb->idle_work,
+			msecs_to_jiffies(fb->idle_timeout_ms));
+	if (vgfb_guest_update(fb))
+		vgfb_status_write(fb, info);
+	spin_unlock_irq(&fb->state_lock);
+	mutex_unlock(&fb->lock);
+	wake_up(&fb->wait);
+	return 0;
+}
+
+static int vgfb_release(struct fb_info *info, int user)
+{
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	mutex_lock(&fb->lock);
+	if (!user)
+		fb->fbcon_count--;
+	spin_lock_irq(&fb->state_lock);
+	fb->guest_users--;
+	if (vgfb_guest_update(fb))
+		vgfb_status_write(fb, info);
+	spin_unlock_irq(&fb->state_lock);
+	mutex_unlock(&fb->lock);
+	wake_up(&fb->wait);
+	return 0;
+}
+
+void vgfb_snapshot_release(struct vgfbm *fb)
+{
+	struct vgfb_snapshot *s;
+
+	mutex_lock(&fb->lock);
+	s = fb->snapshot;
+	fb->snapshot = 0;
+	mutex_unlock(&fb->lock);
+	if (s)
+		vgfb_snapshot_put(s);
+}
+
+int vgfb_snapshot_mmap_current(struct vgfbm *fb, struct vm_area_struct *vma)
+{
+	int ret;
+
+	mutex_lock(&fb->lock);
+	if (!fb->snapshot)
+		ret = -ENODATA;
+	else
+		ret = vgfb_snapshot_mmap(fb->snapshot, vma, vma->vm_pgoff
+					 - (VGFBM_MMAP_SNAPSHOT >> PAGE_SHIFT));
+	mutex_unlock(&fb->lock);
+	return ret;
+}
+
+int vgfb_set_ring(struct fb_info *info, struct vgfbm_ring_setup *setup)
+{
+	int ret = 0;
+	u64 size;
+	struct vgfb_ring *ring = 0, *old = 0;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (setup->slots > VGFBM_MAX_RING_SLOTS)
+		return -EINVAL;
+
+	mutex_lock(&fb->lock);
+	if (setup->slots) {
+		size = setup->slot_size;
+		if (!size)
+			size = ALIGN(sizeof(struct vgfbm_ring_slot), 64)
+			     + (u64)info->var.xres * info->var.yres * 4;
+		size = PAGE_ALIGN(size);
+		if (size * setup->slots
+		    > VGFBM_MMAP_SNAPSHOT - VGFBM_MMAP_RING - PAGE_SIZE) {
+			ret = -EINVAL;
+			goto end;
+		}
+		ring = vgfb_ring_alloc(setup->slots, size);
+		if (!ring) {
+			ret = -ENOMEM;
+			goto end;
+		}
+		setup->slot_size = size;
+		setup->size = ring->size;
+	} else {
+		setup->slot_size = 0;
+		setup->size = 0;
 	}
-	e->count = val;
-	mutex_unlock(&e->lock);
-	return true;
+	spin_lock_irq(&fb->state_lock);
+	old = fb->ring;
+	fb->ring = ring;
+	/* A new ring starts out with the whole frame */
+	fb->ring_damage = (struct vgfb_damage){ 0, 0, info->var.xres_virtual,
+						info->var.yres_virtual };
+	fb->ring_pending = (struct vgfb_damage){ 0 };
+	spin_unlock_irq(&fb->state_lock);
+end:
+	mutex_unlock(&fb->lock);
+	if (old)
+		vgfb_ring_put(old);
+	if (ring)
+		mod_delayed_work(system_wq, &fb->ring_work, 0);
+	return ret;
+}
+
+void vgfb_ring_release(struct vgfbm *fb)
+{
+	struct vgfb_ring *ring;
+
+	mutex_lock(&fb->lock);
+	spin_lock_irq(&fb->state_lock);
+	ring = fb->ring;
+	fb->ring = 0;
+	spin_unlock_irq(&fb->state_lock);
+	mutex_unlock(&fb->lock);
+	if (ring)
+		vgfb_ring_put(ring);
+}
+
+int vgfb_ring_mmap_current(struct vgfbm *fb, struct vm_area_struct *vma)
+{
+	int ret;
+
+	mutex_lock(&fb->lock);
+	if (!fb->ring)
+		ret = -ENODATA;
+	else
+		ret = vgfb_ring_mmap(fb->ring, vma, vma->vm_pgoff
+				     - (VGFBM_MMAP_RING >> PAGE_SHIFT));
+	mutex_unlock(&fb->lock);
+	return ret;
+}
+
+/*
+ * Takes the part of the ring's damage inside the shown frame into d. What
+ * lies outside, as far as a box can hold it, is set aside in ring_pending
+ * until the next pan, so it isn't sent again with every later slot.
+ * Needs fb->state_lock.
+ */
+static bool vgfb_ring_take(struct vgfbm *fb, const struct fb_info *info,
+		struct vgfb_damage *d)
+{
+	struct vgfb_damage *r = &fb->ring_damage;
+	struct vgfb_damage rest = *r;
+	u32 x1 = info->var.xoffset, y1 = info->var.yoffset;
+	u32 x2 = x1 + info->var.xres, y2 = y1 + info->var.yres;
+
+	d->x1 = max(r->x1, x1);
+	d->y1 = max(r->y1, y1);
+	d->x2 = min(r->x2, x2);
+	d->y2 = min(r->y2, y2);
+	if (d->x1 >= d->x2 || d->y1 >= d->y2) {
+		*d = (struct vgfb_damage){ 0 };
+	} else if (d->x1 == r->x1 && d->x2 == r->x2) {
+		/* Whole rows were taken, keep what's above or below */
+		if (d->y1 == r->y1)
+			rest.y1 = d->y2;
+		else if (d->y2 == r->y2)
+			rest.y2 = d->y1;
+	} else if (d->y1 == r->y1 && d->y2 == r->y2) {
+		if (d->x1 == r->x1)
+			rest.x1 = d->x2;
+		else if (d->x2 == r->x2)
+			rest.x2 = d->x1;
+	}
+	if (rest.x1 < rest.x2 && rest.y1 < rest.y2)
+		vgfb_damage_merge(&fb->ring_pending, rest.x1, rest.y1,
+				  rest.x2 - rest.x1, rest.y2 - rest.y1);
+	*r = (struct vgfb_damage){ 0 };
+	return d->x1 < d->x2;
 }
 
-void vgfb_release_screen_memory(struct vm_mem_entry *e)
+static void vgfb_ring_flush(struct vgfbm *fb, struct fb_info *info)
 {
-	unsigned long val;
-	struct vgfbm *fb;
+	struct vgfb_damage d;
+	struct vgfbm_ring_slot slot = { 0 };
+	struct vgfb_ring *ring = fb->ring;
 
-	mutex_lock(&e->lock);
-	val = e->count;
-	if (!val) {
-		mutex_unlock(&e->lock);
-		pr_crit("underflow; use-after-free\n");
-		dump_stack();
+	if (!ring || !fb->last_mem_entry
+	 || info->state != FBINFO_STATE_RUNNING)
+		return;
+
+	spin_lock_irq(&fb->state_lock);
+	if (vgfb_ring_full(ring)) {
+		/* Damage accumulates until the master makes room */
+		schedule_delayed_work(&fb->ring_work, vgfb_frame_jiffies(fb));
+		spin_unlock_irq(&fb->state_lock);
 		return;
 	}
-	val--;
-	e->count = val;
-	mutex_unlock(&e->lock);
-	if (val)
+	if (!vgfb_ring_take(fb, info, &d)) {
+		spin_unlock_irq(&fb->state_lock);
 		return;
-	pr_debug("vgfb: freeing screen memory %p\n", e->memory);
-	vfree(e->memory);
-	fb = e->fb;
-	kfree(e);
-	vgfbm_release(fb);
+	}
+	slot.frame_seq = fb->frame_seq;
+	slot.generation = fb->generation;
+	spin_unlock_irq(&fb->state_lock);
+
+	slot.xres = info->var.xres;
+	slot.yres = info->var.yres;
+	slot.rect = (struct vgfbm_damage){ d.x1 - info->var.xoffset,
+					   d.y1 - info->var.yoffset,
+					   d.x2 - d.x1, d.y2 - d.y1 };
+	slot.stride = slot.rect.width * 4;
+	slot.data_offset = ALIGN(sizeof(slot), 64);
+	if (vgfb_ring_push(ring, fb->last_mem_entry, &slot,
+			   d.y1 * info->fix.line_length + d.x1 * 4,
+			   info->fix.line_length) < 0)
+		return;
+	/* A master consuming the ring watches the device */
+	WRITE_ONCE(fb->last_watched, jiffies);
+	wake_up(&fb->wait);
 }
 
-int vgfb_mmap(struct fb_info *info, struct vm_area_struct *vma)
+void vgfb_ring_work(struct work_struct *work)
+{
+	struct fb_info *info;
+	struct vgfbm *fb = container_of(to_delayed_work(work), struct vgfbm,
+					ring_work);
+
+	/* fb->info stays while info_lock is held */
+	mutex_lock(&fb->info_lock);
+	info = fb->info;
+	if (info && lock_fb_info(info)) {
+		mutex_lock(&fb->lock);
+		vgfb_ring_flush(fb, info);
+		mutex_unlock(&fb->lock);
+		unlock_fb_info(info);
+	}
+	mutex_unlock(&fb->info_lock);
+}
+
+/* Averages an n * n block of pixels, n being 1 << shift */
+static u32 vgfb_box(const u32 *src, u32 pitch, u32 shift)
+{
+	u32 i, j, p, even = 0, odd = 0;
+	u32 n = 1 << shift;
+
+	/* Two channels per word, the sums of up to 64 pixels fit 16 bits */
+	for (j = 0; j < n; j++) {
+		for (i = 0; i < n; i++) {
+			p = src[j * pitch + i];
+			even += p & 0x00ff00ff;
+			odd += (p >> 8) & 0x00ff00ff;
+		}
+	}
+	return (even >> 2 * shift & 0x00ff00ff)
+	     | (odd >> 2 * shift & 0x00ff00ff) << 8;
+}
+
+int vgfb_thumbnail(struct fb_info *info, struct vgfbm_thumbnail *t)
 {
 	int ret = 0;
+	u32 x1, y1, x2, y2, tx, ty, j, tw, th, w, n, rows;
+	u32 *src = 0, *row = 0;
+	unsigned long offset;
+	unsigned long line_length = info->fix.line_length;
+	struct vgfb_damage d = { 0 };
+	char __user *buf = u64_to_user_ptr(t->buffer);
 	struct vgfbm *fb = *(struct vgfbm **)info->par;
 
+	if (!t->shift || t->shift > VGFBM_THUMBNAIL_MAX_SHIFT)
+		return -EINVAL;
+	if (t->flags & ~(VGFBM_THUMBNAIL_BOX | VGFBM_THUMBNAIL_DAMAGE))
+		return -EINVAL;
+	n = 1 << t->shift;
+	rows = t->flags & VGFBM_THUMBNAIL_BOX ? n : 1;
+
 	mutex_lock(&fb->lock);
 	if (info->state != FBINFO_STATE_RUNNING) {
 		ret = -EPERM;
 		goto end;
 	}
 	if (!fb->last_mem_entry) {
-		pr_err("vgfb: screen buffer memory unavailable\n");
 		ret = -ENOMEM;
 		goto end;
 	}
-	if (!vgfb_acquire_screen_memory(fb->last_mem_entry)) {
-		pr_err("vgfb: vgfb_acquire_screen_memory failed\n");
-		ret = -EAGAIN;
+	tw = info->var.xres >> t->shift;
+	th = info->var.yres >> t->shift;
+	if (!tw || !th || t->stride < tw * 4 || t->buffer_size < tw * 4
+	 || (u64)(th - 1) * t->stride > t->buffer_size - tw * 4) {
+		ret = -EINVAL;
 		goto end;
 	}
-	ret = remap_vmalloc_range(vma, fb->last_mem_entry->memory,
-				  vma->vm_pgoff);
-	if (ret < 0) {
-		pr_err("vgfb: remap_vmalloc_range failed (%d)\n", ret);
-		goto failed;
+
+	x1 = 0;
+	y1 = 0;
+	x2 = info->var.xres;
+	y2 = info->var.yres;
+	spin_lock_irq(&fb->state_lock);
+	t->frame_seq = fb->frame_seq;
+	if (t->flags & VGFBM_THUMBNAIL_DAMAGE) {
+		d = fb->damage;
+		fb->damage = (struct vgfb_damage){ 0 };
+		vgfb_status_write(fb, info);
 	}
-	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
-	vma->vm_private_data = fb->last_mem_entry;
-	vma->vm_ops = &vm_default_ops;
-	pr_debug("vgfb: %s\n", __func__);
+	spin_unlock_irq(&fb->state_lock);
+
+	if (t->flags & VGFBM_THUMBNAIL_DAMAGE) {
+		/* Damage is in virtual screen coordinates */
+		if (d.x1 >= d.x2 || d.y2 <= info->var.yoffset
+		 || d.y1 >= info->var.yoffset + y2) {
+			x2 = 0;
+		} else {
+			x1 = d.x1;
+			x2 = min(d.x2, x2);
+			y1 = max(d.y1, info->var.yoffset) - info->var.yoffset;
+			y2 = min(d.y2 - info->var.yoffset, y2);
+		}
+	} else if (t->area.width) {
+		if (t->area.x >= x2 || t->area.width > x2 - t->area.x
+		 || t->area.y >= y2 || t->area.height > y2 - t->area.y) {
+			ret = -EINVAL;
+			goto end;
+		}
+		x1 = t->area.x;
+		y1 = t->area.y;
+		x2 = x1 + t->area.width;
+		y2 = y1 + t->area.height;
+	}
+
+	/* Whole blocks covering the area */
+	x1 >>= t->shift;
+	y1 >>= t->shift;
+	x2 = min(DIV_ROUND_UP(x2, n), tw);
+	y2 = min(DIV_ROUND_UP(y2, n), th);
+	t->width = tw;
+	t->height = th;
+	t->area = (struct vgfbm_damage){ 0 };
+	if (x1 >= x2 || y1 >= y2)
+		goto end;
+
+	w = (x2 - x1) * n;
+	src = kvmalloc_array(rows, w * 4, GFP_KERNEL);
+	row = kvmalloc_array(x2 - x1, 4, GFP_KERNEL);
+	if (!src || !row) {
+		ret = -ENOMEM;
+		goto end;
+	}
+	for (ty = y1; ty < y2; ty++) {
+		for (j = 0; j < rows; j++) {
+			offset = (info->var.yoffset + ty * n + j) * line_length
+			       + x1 * n * 4;
+			vgfb_mem_read(fb->last_mem_entry, offset, src + j * w,
+				      w * 4);
+		}
+		for (tx = 0; tx < x2 - x1; tx++)
+			row[tx] = rows > 1 ? vgfb_box(src + tx * n, w, t->shift)
+					   : src[tx * n];
+		if (copy_to_user(buf + (size_t)ty * t->stride + x1 * 4, row,
+				 (x2 - x1) * 4)) {
+			ret = -EFAULT;
+			goto end;
+		}
+	}
+	t->area = (struct vgfbm_damage){ x1, y1, x2 - x1, y2 - y1 };
+
 end:
 	mutex_unlock(&fb->lock);
+	kvfree(row);
+	kvfree(src);
 	return ret;
-failed:
+}
+
+int vgfb_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	int ret = 0;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	mutex_lock(&fb->lock);
+	if (info->state != FBINFO_STATE_RUNNING) {
+		ret = -EPERM;
+		goto end;
+	}
+	if (!fb->last_mem_entry) {
+		pr_err("vgfb: screen buffer memory unavailable\n");
+		ret = -ENOMEM;
+		goto end;
+	}
+	ret = vgfb_mem_mmap(fb->last_mem_entry, vma);
+	if (ret < 0) {
+		pr_err("vgfb: vgfb_mem_mmap failed (%d)\n", ret);
+		goto end;
+	}
+	pr_debug("vgfb: %s\n", __func__);
+end:
 	mutex_unlock(&fb->lock);
-	vgfb_release_screen_memory(fb->last_mem_entry);
 	return ret;
 }
 
 int vgfb_pan_display(struct fb_var_screeninfo *var, struct fb_info *info)
 {
+	unsigned long flags;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
 	if (info->state != FBINFO_STATE_RUNNING)
 		return -EPERM;
 	if (var->xoffset > info->var.xres_virtual - info->var.xres)
@@ -540,9 +1527,381 @@ int vgfb_pan_display(struct fb_var_screeninfo *var, struct fb_info *info)
 		return -EINVAL;
 	info->var.xoffset = var->xoffset;
 	info->var.yoffset = var->yoffset;
+
+	spin_lock_irqsave(&fb->state_lock, flags);
+	fb->frame_seq++;
+	/* What the ring set aside may be inside the new frame */
+	if (fb->ring_pending.x1 < fb->ring_pending.x2)
+		vgfb_damage_merge(&fb->ring_damage, fb->ring_pending.x1,
+				  fb->ring_pending.y1,
+				  fb->ring_pending.x2 - fb->ring_pending.x1,
+				  fb->ring_pending.y2 - fb->ring_pending.y1);
+	fb->ring_pending = (struct vgfb_damage){ 0 };
+	vgfb_status_write(fb, info);
+	spin_unlock_irqrestore(&fb->state_lock, flags);
+	vgfb_damage_add(info, var->xoffset, var->yoffset,
+			info->var.xres, info->var.yres);
+	/* A flip completes a frame, hand it to the ring right away */
+	if (READ_ONCE(fb->ring))
+		mod_delayed_work(system_wq, &fb->ring_work, 0);
+	return 0;
+}
+
+static bool vgfb_paced(struct vgfbm *fb, u32 max_pending)
+{
+	bool ret;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fb->state_lock, flags);
+	ret = fb->frame_seq - fb->acked_seq < max_pending
+	   || vgfb_blank_state(fb);
+	spin_unlock_irqrestore(&fb->state_lock, flags);
+	return ret;
+}
+
+/*
+ * Holds the guest back while the master is more than max_pending frames
+ * behind. The timeout keeps an unwatched device crawling along instead of
+ * stopping it. Sleeps, so never with the console or fb_info lock held.
+ */
+static int vgfb_pace(struct vgfbm *fb)
+{
+	long ret;
+	u32 max_pending = READ_ONCE(fb->max_pending);
+
+	if (!max_pending || oops_in_progress)
+		return 0;
+	ret = wait_event_interruptible_timeout(fb->wait,
+		vgfb_paced(fb, max_pending),
+		msecs_to_jiffies(READ_ONCE(fb->pacing_timeout_ms)));
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * FBIO_WAITFORVSYNC, also where pacing holds the guest back. fb_ioctl runs
+ * under the fb_info lock, which the master needs as well, so it's dropped
+ * while waiting and taken again for the fb core to release. That only
+ * fails if fbops went away, which this driver never clears.
+ */
+static int vgfb_wait_for_vsync(struct fb_info *info)
+{
+	int ret = 0;
+	ktime_t next;
+	unsigned long flags;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (info->state != FBINFO_STATE_RUNNING)
+		return -EPERM;
+	/* The device may get removed while the lock is dropped */
+	if (!vgfbm_acquire(fb))
+		return -EAGAIN;
+
+	spin_lock_irqsave(&fb->state_lock, flags);
+	next = ktime_add_ns(fb->last_vblank, NSEC_PER_SEC / fb->refresh_rate);
+	spin_unlock_irqrestore(&fb->state_lock, flags);
+
+	unlock_fb_info(info);
+	if (ktime_before(ktime_get(), next)) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (schedule_hrtimeout(&next, HRTIMER_MODE_ABS))
+			ret = -EINTR;
+	}
+	if (!ret)
+		ret = vgfb_pace(fb);
+	if (!lock_fb_info(info))
+		ret = -ENODEV;
+	else if (!ret && info->state != FBINFO_STATE_RUNNING)
+		ret = -ENODEV;
+	if (ret < 0)
+		goto end;
+
+	spin_lock_irqsave(&fb->state_lock, flags);
+	fb->last_vblank = ktime_get();
+	/* A blanked display keeps the pace, but has no vblanks to report */
+	if (!vgfb_blank_state(fb)) {
+		fb->vblank_seq++;
+		vgfb_status_write(fb, info);
+	}
+	spin_unlock_irqrestore(&fb->state_lock, flags);
+
+end:
+	vgfbm_release(fb);
+	return ret;
+}
+
+/*
+ * Records a blank request of the guest or the master. The device counts
+ * as blanked while either of them has it blanked.
+ */
+int vgfb_set_blank(struct fb_info *info, int blank, bool master)
+{
+	bool was, now;
+	unsigned long flags;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (blank < FB_BLANK_UNBLANK || blank > FB_BLANK_POWERDOWN)
+		return -EINVAL;
+
+	spin_lock_irqsave(&fb->state_lock, flags);
+	was = vgfb_blank_state(fb);
+	if (master)
+		fb->master_blank = blank;
+	else
+		fb->guest_blank = blank;
+	now = vgfb_blank_state(fb);
+	vgfb_status_write(fb, info);
+	spin_unlock_irqrestore(&fb->state_lock, flags);
+
+	if (now && !was)
+		mod_delayed_work(system_wq, &fb->reclaim_work, 0);
+	if (was && !now)
+		vgfb_damage_add(info, 0, 0, info->var.xres_virtual,
+				info->var.yres_virtual);
+	/* Paced guests don't wait for a blanked master */
+	wake_up(&fb->wait);
 	return 0;
 }
 
+static int vgfb_blank(int blank, struct fb_info *info)
+{
+	return vgfb_set_blank(info, blank, false);
+}
+
+/*
+ * Gives back the screen memory of devices which are blanked or whose
+ * master didn't look at them for reclaim_timeout_ms. Reruns every
+ * reclaim_timeout_ms to catch pages touched since.
+ */
+void vgfb_reclaim_work(struct work_struct *work)
+{
+	bool console;
+	unsigned long timeout, idle, freed = 0;
+	struct vgfbm *fb = container_of(to_delayed_work(work), struct vgfbm,
+					reclaim_work);
+
+	timeout = msecs_to_jiffies(READ_ONCE(fb->reclaim_timeout_ms));
+	idle = jiffies - READ_ONCE(fb->last_watched);
+	if (!vgfb_blanked(fb) && (!timeout || idle < timeout))
+		goto again;
+
+	vgfb_lock(fb, 0, &console);
+	if (fb->last_mem_entry)
+		freed = vgfb_mem_reclaim(fb->last_mem_entry);
+	vgfb_unlock(fb, 0, console);
+	if (freed)
+		pr_debug("vgfb: reclaimed %lu pages\n", freed);
+	idle = 0;
+
+again:
+	if (timeout)
+		schedule_delayed_work(&fb->reclaim_work, timeout - idle);
+}
+
+/* Shares identical screen pages with other devices, see vgfb_mem_dedup */
+unsigned long vgfb_dedup(struct vgfbm *fb)
+{
+	unsigned long freed;
+	struct vm_mem_entry *e;
+
+	/* It locks what it needs, only per page */
+	mutex_lock(&fb->lock);
+	e = fb->last_mem_entry;
+	if (e && !vgfb_acquire_screen_memory(e))
+		e = 0;
+	mutex_unlock(&fb->lock);
+	if (!e)
+		return 0;
+	freed = vgfb_mem_dedup(e);
+	vgfb_release_screen_memory(e);
+	return freed;
+}
+
+/* Turns attached devices idle once nothing was drawn for a while */
+void vgfb_idle_work(struct work_struct *work)
+{
+	bool changed = false;
+	unsigned long timeout, idle;
+	struct vgfbm *fb = container_of(to_delayed_work(work), struct vgfbm,
+					idle_work);
+
+	/* The status page needs the mode, fb->info stays while it's held */
+	mutex_lock(&fb->info_lock);
+	spin_lock_irq(&fb->state_lock);
+	timeout = msecs_to_jiffies(fb->idle_timeout_ms);
+	idle = jiffies - fb->last_drawn;
+	if (fb->guest_active && timeout && fb->info) {
+		if (idle < timeout) {
+			schedule_delayed_work(&fb->idle_work, timeout - idle);
+		} else {
+			fb->guest_active = false;
+			changed = vgfb_guest_update(fb);
+			if (changed)
+				vgfb_status_write(fb, fb->info);
+		}
+	}
+	spin_unlock_irq(&fb->state_lock);
+	mutex_unlock(&fb->info_lock);
+	if (changed)
+		wake_up(&fb->wait);
+}
+
+static bool vgfb_draw_op_valid(const struct vgfb_draw_op *op)
+{
+	if (op->reserved)
+		return false;
+	switch (op->type) {
+	case VGFB_DRAW_FILL:
+	case VGFB_DRAW_COPY:
+		return true;
+	case VGFB_DRAW_IMAGE:
+		return !op->stride || op->stride >= (u64)op->width * 4;
+	}
+	return false;
+}
+
+/*
+ * Runs a batch of guest drawing operations under fb->lock and damages
+ * them in one go, see VGFB_DRAW.
+ */
+static int vgfb_draw(struct fb_info *info, const struct vgfb_draw_op *ops,
+		u32 count)
+{
+	int ret = 0;
+	u32 i, h, n = 0;
+	unsigned long mem;
+	const char __user *src;
+	struct vgfbm_command *cmds, *c;
+	struct vm_mem_entry *e;
+	unsigned long line_length = info->fix.line_length;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	for (i = 0; i < count; i++)
+		if (!vgfb_draw_op_valid(&ops[i]))
+			return -EINVAL;
+
+	cmds = kvmalloc_array(count, sizeof(*cmds), GFP_KERNEL);
+	if (!cmds)
+		return -ENOMEM;
+
+	mutex_lock(&fb->lock);
+	e = fb->last_mem_entry;
+	if (info->state != FBINFO_STATE_RUNNING) {
+		ret = -EPERM;
+		goto end;
+	}
+	if (!e) {
+		ret = -ENOMEM;
+		goto end;
+	}
+	for (i = 0; i < count; i++) {
+		const struct vgfb_draw_op *op = &ops[i];
+		u32 w = op->width;
+
+		h = op->height;
+		if (!w || !h)
+			continue;
+		if (op->x >= info->var.xres_virtual
+		 || op->y >= info->var.yres_virtual)
+			continue;
+		if (w > info->var.xres_virtual - op->x)
+			w = info->var.xres_virtual - op->x;
+		if (h > info->var.yres_virtual - op->y)
+			h = info->var.yres_virtual - op->y;
+		if (op->type == VGFB_DRAW_COPY) {
+			if (op->sx >= info->var.xres_virtual
+			 || op->sy >= info->var.yres_virtual)
+				continue;
+			if (w > info->var.xres_virtual - op->sx)
+				w = info->var.xres_virtual - op->sx;
+			if (h > info->var.yres_virtual - op->sy)
+				h = info->var.yres_virtual - op->sy;
+		}
+
+		c = &cmds[n++];
+		memset(c, 0, sizeof(*c));
+		c->rect = (struct vgfbm_damage){ op->x, op->y, w, h };
+		switch (op->type) {
+		case VGFB_DRAW_FILL:
+			c->type = VGFBM_COMMAND_FILL;
+			c->color = op->color;
+			if (!vgfb_fill(info, e, &c->rect, op->color, false,
+				       GFP_KERNEL)) {
+				ret = -ENOMEM;
+				goto damage;
+			}
+			break;
+		case VGFB_DRAW_COPY:
+			c->type = VGFBM_COMMAND_COPY;
+			c->sx = op->sx;
+			c->sy = op->sy;
+			if (!vgfb_move(info, e, &c->rect, op->sx, op->sy,
+				       GFP_KERNEL)) {
+				ret = -ENOMEM;
+				goto damage;
+			}
+			break;
+		case VGFB_DRAW_IMAGE:
+			mem = op->y * line_length + op->x * 4;
+			src = u64_to_user_ptr(op->image);
+			while (h--) {
+				ret = vgfb_mem_from_user(e, mem, src, w * 4);
+				if (ret)
+					goto damage;
+				mem += line_length;
+				src += op->stride ? op->stride : (u64)op->width * 4;
+			}
+			break;
+		}
+	}
+
+damage:
+	vgfb_damage_add_commands(info, cmds, n);
+end:
+	mutex_unlock(&fb->lock);
+	kvfree(cmds);
+	return ret;
+}
+
+static int vgfb_draw_user(struct fb_info *info,
+		const struct vgfb_draw __user *arg)
+{
+	int ret;
+	struct vgfb_draw d;
+	struct vgfb_draw_op *ops;
+
+	if (copy_from_user(&d, arg, sizeof(d)))
+		return -EFAULT;
+	if (d.flags || d.count > VGFB_MAX_DRAW_OPS)
+		return -EINVAL;
+	if (!d.count)
+		return 0;
+
+	ops = kvmalloc_array(d.count, sizeof(*ops), GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+	if (copy_from_user(ops, u64_to_user_ptr(d.ops),
+			   d.count * sizeof(*ops))) {
+		ret = -EFAULT;
+		goto end;
+	}
+	ret = vgfb_draw(info, ops, d.count);
+
+end:
+	kvfree(ops);
+	return ret;
+}
+
+int vgfb_ioctl(struct fb_info *info, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case FBIO_WAITFORVSYNC:
+		return vgfb_wait_for_vsync(info);
+	case VGFB_DRAW:
+		return vgfb_draw_user(info, (void __user *)arg);
+	}
+	return -ENOTTY;
+}
+
 static struct platform_driver driver = {
 	.probe  = probe,
 	.remove = remove,
@@ -553,10 +1912,19 @@ static struct platform_driver driver = {
 
 int __init vgfb_init(void)
 {
-	return platform_driver_register(&driver);
+	int ret;
+
+	ret = vgfb_mem_init();
+	if (ret)
+		return ret;
+	ret = platform_driver_register(&driver);
+	if (ret)
+		vgfb_mem_exit();
+	return ret;
 }
 
 void __exit vgfb_exit(void)
 {
 	platform_driver_unregister(&driver);
+	vgfb_mem_exit();
 }
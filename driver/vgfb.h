@@ -3,19 +3,125 @@
 
 #include <linux/completion.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
 #include <linux/list.h>
 #include <linux/fb.h>
+#include "vg.h"
 
 #define VGFB_REFRESH_RATE 60lu
+#define VGFB_MAX_REFRESH_RATE 1000lu
+#define VGFB_PACING_TIMEOUT_MS 1000
+#define VGFB_IDLE_TIMEOUT_MS 2000
+#define VGFB_XRES 800
+#define VGFB_YRES 600
+#define VGFB_BUFFERS 2
+/* Zeroed pages kept for fbcon copying frozen pages, about a text row */
+#define VGFB_MEM_SPARE 16
 
+struct iov_iter;
+struct vgfbm_rect;
+struct vgfbm_status;
+struct vgfbm_snapshot;
+struct vgfbm_thumbnail;
+struct vgfb_snapshot;
+struct vgfb_ring;
+struct vgfbm_ring_setup;
+struct eventfd_ctx;
+
+/* Bounding box of drawn pixels, empty if x1 >= x2 or y1 >= y2 */
+struct vgfb_damage {
+	u32 x1;
+	u32 y1;
+	u32 x2;
+	u32 y2;
+};
+
+/*
+ * The emulated cursor plane, the image is width * height pixels. It's
+ * only used once the master asked for it, plane, before that fbcon draws
+ * the cursor into the frame. soft is set while a cursor drawn that way
+ * may still be in the frame.
+ */
+struct vgfb_cursor {
+	bool plane;
+	bool soft;
+	bool enable;
+	u32 x;
+	u32 y;
+	u32 hot_x;
+	u32 hot_y;
+	u32 width;
+	u32 height;
+	u64 seq;
+	u64 image_seq;
+	u64 read_seq;
+	u32 image[VGFBM_CURSOR_MAX * VGFBM_CURSOR_MAX];
+};
+
+/*
+ * Screen memory of one buffer generation. Pages of sparse memory stay NULL
+ * until something writes to them. Reclaimed pages are NULL too, with their
+ * packed contents in packed. frozen counts the snapshots holding a page.
+ * Pages atomic writers failed to get are allocated from fill_work, zap_lock
+ * covers fill_first and fill_last too. Atomic writers copying frozen pages
+ * fall back to the spare pages, pack_lock covers them.
+ */
 struct vm_mem_entry {
 	struct mutex lock;
 	unsigned long count;
-	void *memory;
+	struct page **pages;
+	unsigned long npages;
+	atomic_long_t resident;
+	gfp_t gfp;
+	int node;
+	struct rw_semaphore fault_lock;
+	bool zero_mapped;
+	spinlock_t pack_lock;
+	void **packed;
+	unsigned int *frozen;
+	struct page *spare[VGFB_MEM_SPARE];
+	unsigned int nspare;
+	spinlock_t zap_lock;
+	unsigned long zap_first;
+	unsigned long zap_last;
+	struct work_struct zap_work;
+	unsigned long fill_first;
+	unsigned long fill_last;
+	struct work_struct fill_work;
+	struct vgfbm *fb;
+};
+
+/* A read only handle to a device, see VGFBM_OBSERVE */
+struct vgfbm_observer {
+	struct mutex lock;
 	struct vgfbm *fb;
+	struct list_head list;
+	struct vgfb_damage damage;
+	u64 frame_seq;
+};
+
+/*
+ * Copies and fills for the master, see VGFBM_SET_COMMAND_LOG. count
+ * commands start at head, bounds covers their rects. damage is what
+ * needs redrawing after replaying them.
+ */
+struct vgfb_command_log {
+	bool enable;
+	bool overflow;
+	u32 head;
+	u32 count;
+	struct vgfb_damage bounds;
+	struct vgfb_damage damage;
+	struct vgfbm_command commands[VGFBM_MAX_COMMANDS];
 };
 
 struct vgfbm {
+	struct list_head list;
 	struct mutex count_lock;
 	unsigned long count;
 	struct mutex lock;
@@ -26,13 +132,73 @@ struct vgfbm {
 	struct fb_var_screeninfo old_var;
 	struct fb_videomode videomode;
 	u32 colormap[256];
+	spinlock_t state_lock;
+	u64 frame_seq;
+	u64 vblank_seq;
+	u64 damage_seq;
+	u64 generation;
+	struct vgfb_damage damage;
+	struct vgfbm_status *status;
+	wait_queue_head_t wait;
+	u64 acked_seq;
+	u32 refresh_rate;
+	u32 max_pending;
+	u32 pacing_timeout_ms;
+	ktime_t last_vblank;
+	u32 alloc_policy;
+	u32 alloc_flags;
+	int alloc_node;
+	/*
+	 * The f_mapping of the master and observer files, so zapping the
+	 * screen memory of one device leaves every other device's alone
+	 */
+	struct address_space mapping;
+	struct mutex mapping_lock;
+	struct list_head mappings;
+	int guest_blank;
+	int master_blank;
+	unsigned long last_watched;
+	u32 reclaim_timeout_ms;
+	struct delayed_work reclaim_work;
+	struct vgfb_cursor cursor;
+	struct vgfb_snapshot *snapshot;
+	struct mutex create_lock;
+	bool created;
+	unsigned long initial_resolution[2];
+	u32 buffers;
+	u32 pitch_align;
+	unsigned int fbcon_count;
+	unsigned int guest_users;
+	bool guest_active;
+	u32 guest_state;
+	u64 guest_seq;
+	u64 guest_read_seq;
+	u64 dropped_draws;
+	unsigned long last_drawn;
+	u32 idle_timeout_ms;
+	struct delayed_work idle_work;
+	struct vgfb_ring *ring;
+	struct vgfb_damage ring_damage;
+	struct vgfb_damage ring_pending;
+	struct delayed_work ring_work;
+	struct list_head observers;
+	struct vgfb_command_log command_log;
+	struct work_struct remove_work;
+	struct eventfd_ctx *remove_event;
 };
 
 ssize_t vgfb_read(struct fb_info *info, char __user *buf, size_t count,
 	loff_t *ppos);
 ssize_t vgfb_write(struct fb_info *info, const char __user *buf, size_t count,
 	loff_t *ppos);
-int vgfb_realloc_screen(struct vgfbm *fb);
+ssize_t vgfb_read_iter(struct fb_info *info, struct kiocb *iocb,
+	struct iov_iter *to);
+ssize_t vgfb_write_iter(struct fb_info *info, struct kiocb *iocb,
+	struct iov_iter *from);
+int vgfb_rects_io(struct fb_info *info, const struct vgfbm_rect *rects,
+	u32 count, char __user *buf, u64 size, u32 stride, bool write);
+int vgfb_thumbnail(struct fb_info *info, struct vgfbm_thumbnail *t);
+int vgfb_realloc_screen(struct vgfbm *fb, size_t size);
 void vgfb_free_screen(struct vgfbm *fb);
 int vgfb_mmap(struct fb_info *info, struct vm_area_struct *vma);
 int vgfb_set_par(struct fb_info *info);
@@ -40,6 +206,7 @@ int vgfb_check_var(struct fb_var_screeninfo *var, struct fb_info *info);
 int vgfb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
 	u_int transp, struct fb_info *info);
 int vgfb_pan_display(struct fb_var_screeninfo *var, struct fb_info *info);
+int vgfb_ioctl(struct fb_info *info, unsigned int cmd, unsigned long arg);
 void vgfb_fillrect(struct fb_info *info, const struct fb_fillrect *rect);
 void vgfb_copyarea(struct fb_info *info, const struct fb_copyarea *region);
 void vgfb_imageblit(struct fb_info *info, const struct fb_image *image);
@@ -47,11 +214,28 @@ int vfb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
 		 u_int transp, struct fb_info *info);
 void vgfb_fb_destroy(struct fb_info *info);
 
-bool vgfb_acquire_screen_memory(struct vm_mem_entry *fb);
-void vgfb_release_screen_memory(struct vm_mem_entry *fb);
+void vgfb_damage_add(struct fb_info *info, u32 x, u32 y, u32 width,
+	u32 height);
+void vgfb_damage_all(struct vgfbm *fb, const struct fb_info *info);
+void vgfb_command_log_reset(struct vgfbm *fb, const struct fb_info *info);
+void vgfb_status_write(struct vgfbm *fb, const struct fb_info *info);
+int vgfb_set_blank(struct fb_info *info, int blank, bool master);
+int vgfb_snapshot(struct fb_info *info, struct vgfbm_snapshot *snap);
+void vgfb_snapshot_release(struct vgfbm *fb);
+bool vgfb_lock(struct vgfbm *fb, struct fb_info *info, bool *console);
+void vgfb_unlock(struct vgfbm *fb, struct fb_info *info, bool console);
+int vgfb_snapshot_mmap_current(struct vgfbm *fb, struct vm_area_struct *vma);
+void vgfb_reclaim_work(struct work_struct *work);
+unsigned long vgfb_dedup(struct vgfbm *fb);
+void vgfb_idle_work(struct work_struct *work);
+int vgfb_set_ring(struct fb_info *info, struct vgfbm_ring_setup *setup);
+void vgfb_ring_release(struct vgfbm *fb);
+int vgfb_ring_mmap_current(struct vgfbm *fb, struct vm_area_struct *vma);
+void vgfb_ring_work(struct work_struct *work);
+
 bool vgfb_check_switch(struct vgfbm *fb);
 
-int vgfb_set_screenbase(struct vgfbm *fb, void *memory);
+int vgfb_set_screenbase(struct vgfbm *fb, struct vm_mem_entry *entry);
 
 int vgfb_create(struct vgfbm *vgfb);
 void vgfb_remove(struct vgfbm *vgfb);
@@ -0,0 +1,1420 @@
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
+#include <linux/hashtable.h>
+#if IS_ENABLED(CONFIG_XXHASH)
+#include <linux/xxhash.h>
+#else
+#include <linux/jhash.h>
+#endif
+#include "vgfbmem.h"
+#include "vgfb.h"
+#include "vg.h"
+
+/* Same zone choice as vmalloc_32 */
+#if defined(CONFIG_64BIT) && defined(CONFIG_ZONE_DMA32)
+#define VGFB_GFP_32 GFP_DMA32
+#elif defined(CONFIG_64BIT) && defined(CONFIG_ZONE_DMA)
+#define VGFB_GFP_32 GFP_DMA
+#else
+#define VGFB_GFP_32 0
+#endif
+
+/* Bytes copyarea moves per step, pages can't be mapped two at a time */
+#define VGFB_MOVE_CHUNK 512
+
+#define VGFB_PAGE_PIXELS (PAGE_SIZE / 4)
+/* Packing a page is only worth it if it at least halves it */
+#define VGFB_PACK_MAX_RUNS (PAGE_SIZE / 16)
+
+struct vgfb_mapping {
+	struct list_head list;
+	struct address_space *mapping;
+	unsigned long count;
+};
+
+/*
+ * A page content seen by the dedup scanner. Shared pages are held by the
+ * table and every entry using them, which all have them frozen. Until a
+ * second page with the same hash shows up, only where it was seen first
+ * is remembered, in owner and idx, and page is NULL. owner is never
+ * dereferenced.
+ */
+struct vgfb_dedup_page {
+	struct hlist_node link;
+	u64 hash;
+	struct page *page;
+	const struct vm_mem_entry *owner;
+	unsigned long idx;
+	gfp_t gfp;
+	int nid;
+	unsigned long pass;
+};
+
+static DEFINE_HASHTABLE(vgfb_dedup_pages, 10);
+static DEFINE_MUTEX(vgfb_dedup_lock);
+static unsigned long vgfb_dedup_pass;
+
+/*
+ * Mapped read-only in place of sparse pages nobody has written yet. It's
+ * never written, the first write fault replaces it with a real page.
+ */
+static struct page *vgfb_zero_page;
+
+static void vm_open(struct vm_area_struct *vma);
+static void vm_close(struct vm_area_struct *vma);
+static vm_fault_t vm_fault(struct vm_fault *vmf);
+static vm_fault_t vm_page_mkwrite(struct vm_fault *vmf);
+
+static const struct vm_operations_struct vm_default_ops = {
+	.open = vm_open,
+	.close = vm_close,
+	.fault = vm_fault,
+	.page_mkwrite = vm_page_mkwrite,
+};
+
+static int vgfb_mapping_get(struct vgfbm *fb, struct address_space *mapping)
+{
+	struct vgfb_mapping *m;
+
+	mutex_lock(&fb->mapping_lock);
+	list_for_each_entry(m, &fb->mappings, list) {
+		if (m->mapping == mapping) {
+			m->count++;
+			mutex_unlock(&fb->mapping_lock);
+			return 0;
+		}
+	}
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m) {
+		mutex_unlock(&fb->mapping_lock);
+		return -ENOMEM;
+	}
+	m->mapping = mapping;
+	m->count = 1;
+	list_add(&m->list, &fb->mappings);
+	mutex_unlock(&fb->mapping_lock);
+	return 0;
+}
+
+static void vgfb_mapping_put(struct vgfbm *fb, struct address_space *mapping)
+{
+	struct vgfb_mapping *m;
+
+	mutex_lock(&fb->mapping_lock);
+	list_for_each_entry(m, &fb->mappings, list) {
+		if (m->mapping != mapping)
+			continue;
+		if (!--m->count) {
+			list_del(&m->list);
+			kfree(m);
+		}
+		break;
+	}
+	mutex_unlock(&fb->mapping_lock);
+}
+
+/* Drops user mappings of the screen memory pages first to last - 1 */
+void vgfb_zap_mappings(struct vgfbm *fb, unsigned long first,
+		unsigned long last)
+{
+	struct vgfb_mapping *m;
+
+	mutex_lock(&fb->mapping_lock);
+	list_for_each_entry(m, &fb->mappings, list)
+		unmap_mapping_range(m->mapping, (loff_t)first << PAGE_SHIFT,
+				    (loff_t)(last - first) << PAGE_SHIFT, 1);
+	mutex_unlock(&fb->mapping_lock);
+}
+
+static void vgfb_mem_zap_work(struct work_struct *work)
+{
+	unsigned long first, last;
+	struct vm_mem_entry *e = container_of(work, struct vm_mem_entry,
+					      zap_work);
+
+	spin_lock_irq(&e->zap_lock);
+	first = e->zap_first;
+	last = e->zap_last;
+	e->zap_first = ULONG_MAX;
+	e->zap_last = 0;
+	spin_unlock_irq(&e->zap_lock);
+	if (first >= last)
+		return;
+
+	down_write(&e->fault_lock);
+	vgfb_zap_mappings(e->fb, first, last);
+	up_write(&e->fault_lock);
+}
+
+/*
+ * Packed pages are a run count followed by count/colour pairs. Unpacks
+ * len bytes starting at byte off of the page into buf.
+ */
+static void vgfb_mem_unpack(const u32 *packed, unsigned long off, u8 *buf,
+		size_t len)
+{
+	u32 i, color;
+	size_t n, k;
+	unsigned long end, pos = 0;
+
+	for (i = 0; i < packed[0] && len; i++) {
+		end = pos + (unsigned long)packed[1 + 2 * i] * 4;
+		if (off < end) {
+			color = packed[2 + 2 * i];
+			n = min_t(size_t, end - off, len);
+			for (k = 0; k < n; k++)
+				*buf++ = ((u8 *)&color)[(off + k) & 3];
+			off += n;
+			len -= n;
+		}
+		pos = end;
+	}
+}
+
+/*
+ * Run length encodes a page. Pages which are all zero become holes and
+ * give a NULL *packed. Fails with -E2BIG if packing wouldn't pay off.
+ */
+static int vgfb_mem_pack(struct page *page, u32 **packed)
+{
+	int ret = 0;
+	u32 *mem, *p;
+	unsigned int i, j, runs = 1;
+
+	mem = kmap(page);
+	for (i = 1; i < VGFB_PAGE_PIXELS; i++)
+		if (mem[i] != mem[i - 1])
+			runs++;
+	if (runs > VGFB_PACK_MAX_RUNS) {
+		ret = -E2BIG;
+		goto end;
+	}
+	if (runs == 1 && !mem[0]) {
+		*packed = 0;
+		goto end;
+	}
+	p = kmalloc_array(1 + 2 * runs, sizeof(*p), GFP_KERNEL);
+	if (!p) {
+		ret = -ENOMEM;
+		goto end;
+	}
+	p[0] = runs;
+	p[1] = 1;
+	p[2] = mem[0];
+	for (i = 1, j = 1; i < VGFB_PAGE_PIXELS; i++) {
+		if (mem[i] == mem[i - 1]) {
+			p[j]++;
+			continue;
+		}
+		j += 2;
+		p[j] = 1;
+		p[j + 1] = mem[i];
+	}
+	*packed = p;
+
+end:
+	kunmap(page);
+	return ret;
+}
+
+/* Whether reclaim packed page idx */
+static bool vgfb_mem_packed(struct vm_mem_entry *e, unsigned long idx)
+{
+	bool ret;
+	unsigned long flags;
+
+	if (!READ_ONCE(e->packed))
+		return false;
+	spin_lock_irqsave(&e->pack_lock, flags);
+	ret = e->packed[idx] && !e->pages[idx];
+	spin_unlock_irqrestore(&e->pack_lock, flags);
+	return ret;
+}
+
+/* Whether a snapshot holds page idx, writers must copy it first */
+static bool vgfb_mem_frozen(struct vm_mem_entry *e, unsigned long idx)
+{
+	unsigned int *frozen = READ_ONCE(e->frozen);
+
+	return frozen && READ_ONCE(frozen[idx]);
+}
+
+/* Zaps mappings of page idx from a work item, for atomic callers */
+static void vgfb_mem_zap_later(struct vm_mem_entry *e, unsigned long idx)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&e->zap_lock, flags);
+	e->zap_first = min(e->zap_first, idx);
+	e->zap_last = max(e->zap_last, idx + 1);
+	spin_unlock_irqrestore(&e->zap_lock, flags);
+	schedule_work(&e->zap_work);
+}
+
+/*
+ * Allocates page idx from a work item after an atomic writer failed to,
+ * so the next write to it doesn't depend on atomic reserves.
+ */
+static void vgfb_mem_fill_later(struct vm_mem_entry *e, unsigned long idx)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&e->zap_lock, flags);
+	e->fill_first = min(e->fill_first, idx);
+	e->fill_last = max(e->fill_last, idx + 1);
+	spin_unlock_irqrestore(&e->zap_lock, flags);
+	schedule_work(&e->fill_work);
+}
+
+/*
+ * Tops up the spare pages while any page is frozen, from process context
+ * since atomic writers can't wait for memory to copy frozen pages.
+ */
+static void vgfb_mem_reserve(struct vm_mem_entry *e)
+{
+	struct page *page;
+
+	while (READ_ONCE(e->frozen) && READ_ONCE(e->nspare) < VGFB_MEM_SPARE) {
+		page = alloc_pages_node(e->node, GFP_KERNEL | e->gfp | __GFP_ZERO,
+					0);
+		if (!page)
+			return;
+		spin_lock_irq(&e->pack_lock);
+		if (e->nspare < VGFB_MEM_SPARE) {
+			e->spare[e->nspare++] = page;
+			page = 0;
+		}
+		spin_unlock_irq(&e->pack_lock);
+		if (page) {
+			__free_page(page);
+			return;
+		}
+	}
+}
+
+static struct page *vgfb_mem_spare(struct vm_mem_entry *e)
+{
+	unsigned long flags;
+	struct page *page = 0;
+
+	spin_lock_irqsave(&e->pack_lock, flags);
+	if (e->nspare)
+		page = e->spare[--e->nspare];
+	spin_unlock_irqrestore(&e->pack_lock, flags);
+	/* fill_work tops them up again */
+	if (page)
+		schedule_work(&e->fill_work);
+	return page;
+}
+
+/*
+ * Returns the page backing page idx for writing. Never written pages get
+ * allocated, packed ones unpacked, and pages a snapshot holds get copied
+ * so the snapshot keeps the old contents. Mappings still showing the old
+ * page get zapped from a work item, since callers may be atomic.
+ */
+static struct page *vgfb_mem_page_alloc(struct vm_mem_entry *e,
+		unsigned long idx, gfp_t gfp)
+{
+	unsigned long flags;
+	struct page *page, *old;
+	u32 *packed = 0;
+	void *mem, *src;
+
+	page = READ_ONCE(e->pages[idx]);
+	if (page && !vgfb_mem_frozen(e, idx))
+		return page;
+
+	page = alloc_pages_node(e->node, gfp | e->gfp | __GFP_ZERO, 0);
+	if (!page && !gfpflags_allow_blocking(gfp) && vgfb_mem_frozen(e, idx))
+		page = vgfb_mem_spare(e);
+	if (!page) {
+		if (!gfpflags_allow_blocking(gfp))
+			vgfb_mem_fill_later(e, idx);
+		return 0;
+	}
+	spin_lock_irqsave(&e->pack_lock, flags);
+	old = e->pages[idx];
+	if (old && e->frozen && e->frozen[idx]) {
+		src = kmap_atomic(old);
+		mem = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(mem);
+		kunmap_atomic(src);
+		e->frozen[idx] = 0;
+		smp_store_release(&e->pages[idx], page);
+		spin_unlock_irqrestore(&e->pack_lock, flags);
+		/* The snapshot has its own reference */
+		put_page(old);
+		vgfb_mem_zap_later(e, idx);
+		return page;
+	}
+	if (!old) {
+		if (e->packed) {
+			packed = e->packed[idx];
+			e->packed[idx] = 0;
+		}
+		if (packed) {
+			mem = kmap_atomic(page);
+			vgfb_mem_unpack(packed, 0, mem, PAGE_SIZE);
+			kunmap_atomic(mem);
+		}
+		smp_store_release(&e->pages[idx], page);
+	}
+	spin_unlock_irqrestore(&e->pack_lock, flags);
+	if (old) {
+		__free_page(page);
+		return old;
+	}
+	kfree(packed);
+	atomic_long_inc(&e->resident);
+
+	/* Pairs with the barrier in vm_fault */
+	smp_mb();
+	if (READ_ONCE(e->zero_mapped))
+		vgfb_mem_zap_later(e, idx);
+	return page;
+}
+
+static void vgfb_mem_fill_work(struct work_struct *work)
+{
+	unsigned long i, first, last;
+	struct vm_mem_entry *e = container_of(work, struct vm_mem_entry,
+					      fill_work);
+
+	spin_lock_irq(&e->zap_lock);
+	first = e->fill_first;
+	last = e->fill_last;
+	e->fill_first = ULONG_MAX;
+	e->fill_last = 0;
+	spin_unlock_irq(&e->zap_lock);
+
+	for (i = first; i < last; i++)
+		if (!vgfb_mem_page_alloc(e, i, GFP_KERNEL))
+			break;
+	vgfb_mem_reserve(e);
+}
+
+void vgfb_mem_free(struct vm_mem_entry *e)
+{
+	unsigned long i;
+
+	cancel_work_sync(&e->fill_work);
+	cancel_work_sync(&e->zap_work);
+	for (i = 0; i < e->npages; i++)
+		if (e->pages[i])
+			__free_page(e->pages[i]);
+	if (e->packed) {
+		for (i = 0; i < e->npages; i++)
+			kfree(e->packed[i]);
+		kvfree(e->packed);
+	}
+	for (i = 0; i < e->nspare; i++)
+		__free_page(e->spare[i]);
+	kvfree(e->frozen);
+	kvfree(e->pages);
+	kfree(e);
+}
+
+/*
+ * Allocates size bytes of screen memory according to the device's
+ * allocation policy. Sparse memory only gets its pages on first write.
+ */
+struct vm_mem_entry *vgfb_mem_alloc(struct vgfbm *fb, size_t size)
+{
+	unsigned long i;
+	struct vm_mem_entry *e;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return 0;
+	mutex_init(&e->lock);
+	init_rwsem(&e->fault_lock);
+	spin_lock_init(&e->zap_lock);
+	spin_lock_init(&e->pack_lock);
+	INIT_WORK(&e->zap_work, vgfb_mem_zap_work);
+	INIT_WORK(&e->fill_work, vgfb_mem_fill_work);
+	e->zap_first = ULONG_MAX;
+	e->fill_first = ULONG_MAX;
+	e->fb = fb;
+	/* Sparse pages get allocated later by whoever writes them first */
+	e->node = fb->alloc_node != NUMA_NO_NODE ? fb->alloc_node
+						 : numa_node_id();
+	e->gfp = fb->alloc_policy == VGFBM_ALLOC_ANY ? __GFP_HIGHMEM
+						      : VGFB_GFP_32;
+	e->npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	e->pages = kvcalloc(e->npages, sizeof(*e->pages), GFP_KERNEL);
+	if (!e->pages)
+		goto failed;
+	if (fb->alloc_flags & VGFBM_ALLOC_SPARSE)
+		return e;
+	for (i = 0; i < e->npages; i++)
+		if (!vgfb_mem_page_alloc(e, i, GFP_KERNEL))
+			goto failed;
+	return e;
+
+failed:
+	vgfb_mem_free(e);
+	return 0;
+}
+
+bool vgfb_acquire_screen_memory(struct vm_mem_entry *e)
+{
+	unsigned long val;
+
+	mutex_lock(&e->lock);
+	val = e->count + 1;
+	if (val == 1)
+		vgfbm_acquire(e->fb);
+	if (!val) {
+		mutex_unlock(&e->lock);
+		return false;
+	}
+	e->count = val;
+	mutex_unlock(&e->lock);
+	return true;
+}
+
+void vgfb_release_screen_memory(struct vm_mem_entry *e)
+{
+	unsigned long val;
+	struct vgfbm *fb;
+
+	mutex_lock(&e->lock);
+	val = e->count;
+	if (!val) {
+		mutex_unlock(&e->lock);
+		pr_crit("underflow; use-after-free\n");
+		dump_stack();
+		return;
+	}
+	val--;
+	e->count = val;
+	mutex_unlock(&e->lock);
+	if (val)
+		return;
+	pr_debug("vgfb: freeing screen memory %p\n", e);
+	fb = e->fb;
+	vgfb_mem_free(e);
+	vgfbm_release(fb);
+}
+
+static void vm_open(struct vm_area_struct *vma)
+{
+	struct vm_mem_entry *entry = vma->vm_private_data;
+
+	pr_debug("vgfb: %s\n", __func__);
+	if (!vgfb_acquire_screen_memory(entry))
+		panic("vgfb: vgfb_acquire_screen_memory failed");
+	/* The mapping is already known from the original vma */
+	if (vgfb_mapping_get(entry->fb, vma->vm_file->f_mapping))
+		panic("vgfb: vgfb_mapping_get failed");
+}
+
+static void vm_close(struct vm_area_struct *vma)
+{
+	struct vm_mem_entry *entry = vma->vm_private_data;
+
+	pr_debug("vgfb: %s\n", __func__);
+	vgfb_mapping_put(entry->fb, vma->vm_file->f_mapping);
+	vgfb_release_screen_memory(entry);
+}
+
+/*
+ * Runs with fault_lock held for reading and returns the page locked, so
+ * reclaim can wait for faults which are still about to map a page.
+ */
+static vm_fault_t vm_fault(struct vm_fault *vmf)
+{
+	vm_fault_t ret;
+	struct page *page;
+	struct vm_mem_entry *e = vmf->vma->vm_private_data;
+
+	if (vmf->pgoff >= e->npages)
+		return VM_FAULT_SIGBUS;
+
+	down_read(&e->fault_lock);
+	if (vmf->flags & FAULT_FLAG_WRITE || vgfb_mem_packed(e, vmf->pgoff)) {
+		page = vgfb_mem_page_alloc(e, vmf->pgoff, GFP_KERNEL);
+		if (!page) {
+			ret = VM_FAULT_OOM;
+			goto end;
+		}
+		goto found;
+	}
+
+	page = READ_ONCE(e->pages[vmf->pgoff]);
+	if (page)
+		goto found;
+
+	/*
+	 * Nothing was written there yet. Whoever allocates the page checks
+	 * zero_mapped after publishing it and zaps us once we're done.
+	 */
+	WRITE_ONCE(e->zero_mapped, true);
+	smp_mb();
+	page = READ_ONCE(e->pages[vmf->pgoff]);
+	if (page)
+		goto found;
+	ret = vmf_insert_page(vmf->vma, vmf->address, vgfb_zero_page);
+	goto end;
+
+found:
+	get_page(page);
+	lock_page(page);
+	vmf->page = page;
+	ret = VM_FAULT_LOCKED;
+
+end:
+	up_read(&e->fault_lock);
+	return ret;
+}
+
+/*
+ * Write access to a page mapped read only. The zero page, pages a
+ * snapshot holds and stale pages replaced since get swapped for the
+ * current writable page by zapping them and letting the fault retry.
+ */
+static vm_fault_t vm_page_mkwrite(struct vm_fault *vmf)
+{
+	struct vm_mem_entry *e = vmf->vma->vm_private_data;
+
+	if (vmf->page == READ_ONCE(e->pages[vmf->pgoff])
+	 && !vgfb_mem_frozen(e, vmf->pgoff)) {
+		lock_page(vmf->page);
+		return VM_FAULT_LOCKED;
+	}
+
+	down_write(&e->fault_lock);
+	if (!vgfb_mem_page_alloc(e, vmf->pgoff, GFP_KERNEL)) {
+		up_write(&e->fault_lock);
+		return VM_FAULT_OOM;
+	}
+	vgfb_zap_mappings(e->fb, vmf->pgoff, vmf->pgoff + 1);
+	up_write(&e->fault_lock);
+	return VM_FAULT_NOPAGE;
+}
+
+int vgfb_mem_mmap(struct vm_mem_entry *e, struct vm_area_struct *vma)
+{
+	int ret;
+
+	if (vma->vm_pgoff > e->npages
+	 || vma_pages(vma) > e->npages - vma->vm_pgoff)
+		return -EINVAL;
+	if (!vgfb_acquire_screen_memory(e)) {
+		pr_err("vgfb: vgfb_acquire_screen_memory failed\n");
+		return -EAGAIN;
+	}
+	ret = vgfb_mapping_get(e->fb, vma->vm_file->f_mapping);
+	if (ret < 0) {
+		vgfb_release_screen_memory(e);
+		return ret;
+	}
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP | VM_MIXEDMAP;
+	vma->vm_page_prot = vm_get_page_prot(vma->vm_flags);
+	vma->vm_private_data = e;
+	vma->vm_ops = &vm_default_ops;
+	return 0;
+}
+
+/*
+ * Maps the page holding offset and shortens *len to the part of it that
+ * is left. Without gfp, never written or packed pages give NULL, with gfp
+ * they get allocated. Undo with kunmap_atomic.
+ */
+static void *vgfb_mem_map(struct vm_mem_entry *e, unsigned long offset,
+		size_t *len, gfp_t gfp)
+{
+	struct page *page;
+	unsigned long off = offset & ~PAGE_MASK;
+
+	if (*len > PAGE_SIZE - off)
+		*len = PAGE_SIZE - off;
+	if (gfp)
+		page = vgfb_mem_page_alloc(e, offset >> PAGE_SHIFT, gfp);
+	else
+		page = READ_ONCE(e->pages[offset >> PAGE_SHIFT]);
+	if (!page)
+		return 0;
+	return kmap_atomic(page) + off;
+}
+
+/* Reads from a page which wasn't there, without unpacking it */
+static void vgfb_mem_read_hole(struct vm_mem_entry *e, unsigned long offset,
+		void *buf, size_t len)
+{
+	void *mem;
+	u32 *packed;
+	struct page *page;
+	unsigned long flags;
+	unsigned long idx = offset >> PAGE_SHIFT;
+	unsigned long off = offset & ~PAGE_MASK;
+
+	spin_lock_irqsave(&e->pack_lock, flags);
+	page = e->pages[idx];
+	packed = e->packed ? e->packed[idx] : 0;
+	if (page) {
+		mem = kmap_atomic(page);
+		memcpy(buf, mem + off, len);
+		kunmap_atomic(mem);
+	} else if (packed) {
+		vgfb_mem_unpack(packed, off, buf, len);
+	} else {
+		memset(buf, 0, len);
+	}
+	spin_unlock_irqrestore(&e->pack_lock, flags);
+}
+
+void vgfb_mem_read(struct vm_mem_entry *e, unsigned long offset,
+		void *buf, size_t len)
+{
+	size_t n;
+	void *mem;
+
+	while (len) {
+		n = len;
+		mem = vgfb_mem_map(e, offset, &n, 0);
+		if (mem) {
+			memcpy(buf, mem, n);
+			kunmap_atomic(mem);
+		} else {
+			vgfb_mem_read_hole(e, offset, buf, n);
+		}
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+size_t vgfb_mem_write(struct vm_mem_entry *e, unsigned long offset,
+		const void *buf, size_t len, gfp_t gfp)
+{
+	size_t n, done = 0;
+	void *mem;
+
+	while (done < len) {
+		n = len - done;
+		mem = vgfb_mem_map(e, offset, &n, gfp);
+		if (!mem)
+			break;
+		memcpy(mem, buf, n);
+		kunmap_atomic(mem);
+		buf += n;
+		offset += n;
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * Sets or xors count pixels starting at offset to color. Returns false if
+ * pages couldn't be allocated, the pixels on them are left as they were.
+ */
+bool vgfb_mem_fill(struct vm_mem_entry *e, unsigned long offset, u32 color,
+		size_t count, bool xor, gfp_t gfp)
+{
+	size_t n, i;
+	u32 *mem;
+	bool ret = true;
+
+	while (count) {
+		n = count * 4;
+		mem = vgfb_mem_map(e, offset, &n, gfp);
+		n /= 4;
+		if (!mem) {
+			ret = false;
+			offset += n * 4;
+			count -= n;
+			continue;
+		}
+		if (xor)
+			for (i = 0; i < n; i++)
+				mem[i] ^= color;
+		else
+			for (i = 0; i < n; i++)
+				mem[i] = color;
+		kunmap_atomic(mem);
+		offset += n * 4;
+		count -= n;
+	}
+	return ret;
+}
+
+/* memmove within the screen memory, false if pages couldn't be allocated */
+bool vgfb_mem_move(struct vm_mem_entry *e, unsigned long dst,
+		unsigned long src, size_t len, gfp_t gfp)
+{
+	size_t n;
+	u8 buf[VGFB_MOVE_CHUNK];
+	bool ret = true;
+
+	if (dst <= src) {
+		while (len) {
+			n = min_t(size_t, len, sizeof(buf));
+			vgfb_mem_read(e, src, buf, n);
+			if (vgfb_mem_write(e, dst, buf, n, gfp) != n)
+				ret = false;
+			src += n;
+			dst += n;
+			len -= n;
+		}
+	} else {
+		while (len) {
+			n = min_t(size_t, len, sizeof(buf));
+			len -= n;
+			vgfb_mem_read(e, src + len, buf, n);
+			if (vgfb_mem_write(e, dst + len, buf, n, gfp) != n)
+				ret = false;
+		}
+	}
+	return ret;
+}
+
+int vgfb_mem_to_user(struct vm_mem_entry *e, unsigned long offset,
+		void __user *buf, size_t len)
+{
+	size_t n;
+	unsigned long left;
+	struct page *page;
+	unsigned long off;
+
+	while (len) {
+		off = offset & ~PAGE_MASK;
+		n = min_t(size_t, len, PAGE_SIZE - off);
+		page = READ_ONCE(e->pages[offset >> PAGE_SHIFT]);
+		if (!page && vgfb_mem_packed(e, offset >> PAGE_SHIFT)) {
+			page = vgfb_mem_page_alloc(e, offset >> PAGE_SHIFT,
+						   GFP_KERNEL);
+			if (!page)
+				return -ENOMEM;
+		}
+		if (page) {
+			left = copy_to_user(buf, kmap(page) + off, n);
+			kunmap(page);
+		} else {
+			left = clear_user(buf, n);
+		}
+		if (left)
+			return -EFAULT;
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int vgfb_mem_from_user(struct vm_mem_entry *e, unsigned long offset,
+		const void __user *buf, size_t len)
+{
+	size_t n;
+	unsigned long left;
+	struct page *page;
+	unsigned long off;
+
+	while (len) {
+		off = offset & ~PAGE_MASK;
+		n = min_t(size_t, len, PAGE_SIZE - off);
+		page = vgfb_mem_page_alloc(e, offset >> PAGE_SHIFT, GFP_KERNEL);
+		if (!page)
+			return -ENOMEM;
+		left = copy_from_user(kmap(page) + off, buf, n);
+		kunmap(page);
+		if (left)
+			return -EFAULT;
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Copies through a kernel mapping, copy_page_to_iter would hand pipes a
+ * reference to the live page instead of its contents.
+ */
+size_t vgfb_mem_to_iter(struct vm_mem_entry *e, unsigned long offset,
+		size_t len, struct iov_iter *to)
+{
+	size_t n, copied, done = 0;
+	struct page *page;
+	unsigned long off;
+
+	while (done < len) {
+		off = offset & ~PAGE_MASK;
+		n = min_t(size_t, len - done, PAGE_SIZE - off);
+		page = READ_ONCE(e->pages[offset >> PAGE_SHIFT]);
+		if (!page && vgfb_mem_packed(e, offset >> PAGE_SHIFT)) {
+			page = vgfb_mem_page_alloc(e, offset >> PAGE_SHIFT,
+						   GFP_KERNEL);
+			if (!page)
+				break;
+		}
+		if (page) {
+			copied = copy_to_iter(kmap(page) + off, n, to);
+			kunmap(page);
+		} else
+			copied = iov_iter_zero(n, to);
+		done += copied;
+		offset += copied;
+		if (copied != n)
+			break;
+	}
+	return done;
+}
+
+size_t vgfb_mem_from_iter(struct vm_mem_entry *e, unsigned long offset,
+		size_t len, struct iov_iter *from)
+{
+	size_t n, copied, done = 0;
+	struct page *page;
+	unsigned long off;
+
+	while (done < len) {
+		off = offset & ~PAGE_MASK;
+		n = min_t(size_t, len - done, PAGE_SIZE - off);
+		page = vgfb_mem_page_alloc(e, offset >> PAGE_SHIFT, GFP_KERNEL);
+		if (!page)
+			break;
+		copied = copy_page_from_iter(page, off, n, from);
+		done += copied;
+		offset += copied;
+		if (copied != n)
+			break;
+	}
+	return done;
+}
+
+/*
+ * Removes all user mappings of pages first to last - 1, needs fault_lock
+ * held for writing. Faults which found a page before that hold it locked
+ * until it's mapped, so wait for them and zap again.
+ */
+static void vgfb_mem_unmap(struct vm_mem_entry *e, unsigned long first,
+		unsigned long last)
+{
+	unsigned long i;
+	struct page *page;
+
+	vgfb_zap_mappings(e->fb, first, last);
+	for (i = first; i < last; i++) {
+		page = e->pages[i];
+		if (page) {
+			lock_page(page);
+			unlock_page(page);
+		}
+	}
+	vgfb_zap_mappings(e->fb, first, last);
+}
+
+/*
+ * Gives back the memory of pages nobody else holds. Pages of a single
+ * colour or few runs get packed, all zero pages become holes again. Any
+ * later access unpacks them. Needs the locks vgfb_lock takes, so no
+ * kernel side access can race. Returns the number of pages freed.
+ */
+unsigned long vgfb_mem_reclaim(struct vm_mem_entry *e)
+{
+	unsigned long i, freed = 0;
+	struct page *page;
+	u32 *packed;
+	void **table;
+
+	if (!atomic_long_read(&e->resident))
+		return 0;
+	if (!e->packed) {
+		table = kvcalloc(e->npages, sizeof(*table), GFP_KERNEL);
+		if (!table)
+			return 0;
+		spin_lock_irq(&e->pack_lock);
+		WRITE_ONCE(e->packed, table);
+		spin_unlock_irq(&e->pack_lock);
+	}
+
+	down_write(&e->fault_lock);
+	vgfb_mem_unmap(e, 0, e->npages);
+
+	for (i = 0; i < e->npages; i++) {
+		page = e->pages[i];
+		if (!page || page_count(page) != 1)
+			continue;
+		if (vgfb_mem_pack(page, &packed))
+			continue;
+		spin_lock_irq(&e->pack_lock);
+		e->packed[i] = packed;
+		WRITE_ONCE(e->pages[i], NULL);
+		spin_unlock_irq(&e->pack_lock);
+		atomic_long_dec(&e->resident);
+		__free_page(page);
+		freed++;
+	}
+	up_write(&e->fault_lock);
+	return freed;
+}
+
+/*
+ * Freezes pages first to last - 1 copy-on-write. Needs the locks
+ * vgfb_lock takes, like vgfb_mem_reclaim.
+ */
+struct vgfb_snapshot *vgfb_mem_snapshot(struct vm_mem_entry *e,
+		unsigned long first, unsigned long last)
+{
+	unsigned long i;
+	unsigned int *frozen;
+	struct vgfb_snapshot *s;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return 0;
+	kref_init(&s->ref);
+	s->entry = e;
+	s->first = first;
+	s->npages = last - first;
+	s->pages = kvcalloc(s->npages, sizeof(*s->pages), GFP_KERNEL);
+	if (!s->pages)
+		goto failed;
+	if (!e->frozen) {
+		frozen = kvcalloc(e->npages, sizeof(*frozen), GFP_KERNEL);
+		if (!frozen)
+			goto failed;
+		spin_lock_irq(&e->pack_lock);
+		WRITE_ONCE(e->frozen, frozen);
+		spin_unlock_irq(&e->pack_lock);
+	}
+	if (!vgfb_acquire_screen_memory(e))
+		goto failed;
+
+	/* Packed pages are few colours, but snapshots map real pages */
+	for (i = first; i < last; i++)
+		if (vgfb_mem_packed(e, i) && !vgfb_mem_page_alloc(e, i, GFP_KERNEL))
+			goto failed_after_acquire;
+
+	/* Writable mappings must fault again so writers copy first */
+	down_write(&e->fault_lock);
+	vgfb_mem_unmap(e, first, last);
+	spin_lock_irq(&e->pack_lock);
+	for (i = first; i < last; i++) {
+		s->pages[i - first] = e->pages[i];
+		if (!e->pages[i])
+			continue;
+		get_page(e->pages[i]);
+		e->frozen[i]++;
+	}
+	spin_unlock_irq(&e->pack_lock);
+	up_write(&e->fault_lock);
+	vgfb_mem_reserve(e);
+	return s;
+
+failed_after_acquire:
+	vgfb_release_screen_memory(e);
+failed:
+	kvfree(s->pages);
+	kfree(s);
+	return 0;
+}
+
+/* Only a hint, pages get compared in full before sharing */
+static u64 vgfb_page_hash(struct page *page)
+{
+	u64 hash;
+
+#if IS_ENABLED(CONFIG_XXHASH)
+	hash = xxh64(kmap(page), PAGE_SIZE, 0);
+#else
+	hash = jhash2(kmap(page), PAGE_SIZE / 4, 0);
+#endif
+	kunmap(page);
+	return hash;
+}
+
+static bool vgfb_page_same(struct page *a, struct page *b)
+{
+	bool ret;
+
+	ret = !memcmp(kmap(a), kmap(b), PAGE_SIZE);
+	kunmap(b);
+	kunmap(a);
+	return ret;
+}
+
+/* Pages only get shared between entries allocating them alike */
+static struct vgfb_dedup_page *vgfb_dedup_find(struct vm_mem_entry *e,
+		u64 hash)
+{
+	struct vgfb_dedup_page *d;
+
+	hash_for_each_possible(vgfb_dedup_pages, d, link, hash)
+		if (d->hash == hash && d->gfp == e->gfp && d->nid == e->node)
+			return d;
+	return 0;
+}
+
+/*
+ * Makes page idx of e page and freezes it, so writers copy it first like
+ * for snapshots. Needs fault_lock held for writing, with the old page
+ * unmapped.
+ */
+static void vgfb_mem_share(struct vm_mem_entry *e, unsigned long idx,
+		struct page *page)
+{
+	struct page *old;
+
+	get_page(page);
+	spin_lock_irq(&e->pack_lock);
+	old = e->pages[idx];
+	e->frozen[idx]++;
+	smp_store_release(&e->pages[idx], page);
+	spin_unlock_irq(&e->pack_lock);
+	put_page(old);
+}
+
+/*
+ * Shares page idx of e, which was page with the given hash when the scan
+ * looked at it, through d. Needs the locks vgfb_lock takes and fault_lock
+ * held for writing, and a reference to page besides e's. Returns whether
+ * a page got freed.
+ */
+static bool vgfb_mem_dedup_page(struct vm_mem_entry *e, unsigned long idx,
+		struct page *page, u64 hash, struct vgfb_dedup_page *d)
+{
+	/* Written, reclaimed or frozen since */
+	if (e->pages[idx] != page || e->frozen[idx])
+		return false;
+	/* Writes through mappings may have changed it, stop them */
+	vgfb_mem_unmap(e, idx, idx + 1);
+	if (page_count(page) != 2)
+		return false;
+	if (d->page) {
+		if (!vgfb_page_same(page, d->page))
+			return false;
+		vgfb_mem_share(e, idx, d->page);
+		return true;
+	}
+	/* Seen twice, from now on it's shared */
+	if (vgfb_page_hash(page) != hash)
+		return false;
+	get_page(page);
+	d->page = page;
+	vgfb_mem_share(e, idx, page);
+	return false;
+}
+
+/*
+ * Replaces pages of e with identical ones other entries hold, from this
+ * or earlier passes of the scanner. Pages a snapshot or another entry
+ * holds already are left alone. Pages get hashed without any locks, the
+ * locks vgfb_lock takes are only held to check and replace a candidate.
+ * The caller holds e. Returns the number of pages freed.
+ */
+unsigned long vgfb_mem_dedup(struct vm_mem_entry *e)
+{
+	u64 hash;
+	bool console;
+	unsigned long i, freed = 0;
+	unsigned int *frozen;
+	struct page *page;
+	struct vgfb_dedup_page *d;
+
+	if (!atomic_long_read(&e->resident))
+		return 0;
+	if (!READ_ONCE(e->frozen)) {
+		frozen = kvcalloc(e->npages, sizeof(*frozen), GFP_KERNEL);
+		if (!frozen)
+			return 0;
+		spin_lock_irq(&e->pack_lock);
+		if (!e->frozen) {
+			WRITE_ONCE(e->frozen, frozen);
+			frozen = 0;
+		}
+		spin_unlock_irq(&e->pack_lock);
+		kvfree(frozen);
+	}
+
+	for (i = 0; i < e->npages; i++) {
+		cond_resched();
+		spin_lock_irq(&e->pack_lock);
+		page = e->pages[i];
+		if (page && !e->frozen[i])
+			get_page(page);
+		else
+			page = 0;
+		spin_unlock_irq(&e->pack_lock);
+		if (!page)
+			continue;
+		hash = vgfb_page_hash(page);
+
+		mutex_lock(&vgfb_dedup_lock);
+		d = vgfb_dedup_find(e, hash);
+		if (!d) {
+			d = kzalloc(sizeof(*d), GFP_KERNEL);
+			if (d) {
+				d->hash = hash;
+				d->owner = e;
+				d->idx = i;
+				d->gfp = e->gfp;
+				d->nid = e->node;
+				d->pass = vgfb_dedup_pass;
+				hash_add(vgfb_dedup_pages, &d->link, hash);
+			}
+		} else {
+			d->pass = vgfb_dedup_pass;
+			if (d->page || d->owner != e || d->idx != i) {
+				vgfb_lock(e->fb, 0, &console);
+				down_write(&e->fault_lock);
+				if (vgfb_mem_dedup_page(e, i, page, hash, d))
+					freed++;
+				up_write(&e->fault_lock);
+				vgfb_unlock(e->fb, 0, console);
+			}
+		}
+		mutex_unlock(&vgfb_dedup_lock);
+		put_page(page);
+	}
+	vgfb_mem_reserve(e);
+	return freed;
+}
+
+/*
+ * Ends a pass of the dedup scanner. Shared pages nobody uses anymore are
+ * freed, and pages not seen during the pass forgotten.
+ */
+void vgfb_mem_dedup_end(void)
+{
+	int bkt;
+	struct hlist_node *tmp;
+	struct vgfb_dedup_page *d;
+
+	mutex_lock(&vgfb_dedup_lock);
+	hash_for_each_safe(vgfb_dedup_pages, bkt, tmp, d, link) {
+		if (d->page ? page_count(d->page) > 1
+			    : d->pass == vgfb_dedup_pass)
+			continue;
+		hash_del(&d->link);
+		if (d->page)
+			put_page(d->page);
+		kfree(d);
+	}
+	vgfb_dedup_pass++;
+	mutex_unlock(&vgfb_dedup_lock);
+}
+
+static void vgfb_snapshot_free(struct kref *ref)
+{
+	unsigned long i;
+	struct vgfb_snapshot *s = container_of(ref, struct vgfb_snapshot, ref);
+	struct vm_mem_entry *e = s->entry;
+
+	/* Pages writers copied already aren't frozen anymore */
+	spin_lock_irq(&e->pack_lock);
+	for (i = 0; i < s->npages; i++)
+		if (s->pages[i] && e->pages[s->first + i] == s->pages[i])
+			e->frozen[s->first + i]--;
+	spin_unlock_irq(&e->pack_lock);
+	for (i = 0; i < s->npages; i++)
+		if (s->pages[i])
+			put_page(s->pages[i]);
+	vgfb_release_screen_memory(e);
+	kvfree(s->pages);
+	kfree(s);
+}
+
+void vgfb_snapshot_put(struct vgfb_snapshot *s)
+{
+	kref_put(&s->ref, vgfb_snapshot_free);
+}
+
+static void vgfb_snapshot_vm_open(struct vm_area_struct *vma)
+{
+	struct vgfb_snapshot *s = vma->vm_private_data;
+
+	kref_get(&s->ref);
+}
+
+static void vgfb_snapshot_vm_close(struct vm_area_struct *vma)
+{
+	vgfb_snapshot_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct vgfb_snapshot_vm_ops = {
+	.open = vgfb_snapshot_vm_open,
+	.close = vgfb_snapshot_vm_close,
+};
+
+/* Maps the snapshot read only, starting at page pgoff of it */
+int vgfb_snapshot_mmap(struct vgfb_snapshot *s, struct vm_area_struct *vma,
+		unsigned long pgoff)
+{
+	int ret;
+	unsigned long i;
+	struct page *page;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EACCES;
+	if (pgoff > s->npages || vma_pages(vma) > s->npages - pgoff)
+		return -EINVAL;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	for (i = 0; i < vma_pages(vma); i++) {
+		page = s->pages[pgoff + i];
+		ret = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE,
+				     page ? page : vgfb_zero_page);
+		if (ret < 0)
+			return ret;
+	}
+	kref_get(&s->ref);
+	vma->vm_private_data = s;
+	vma->vm_ops = &vgfb_snapshot_vm_ops;
+	return 0;
+}
+
+/* slot_size is a multiple of PAGE_SIZE, the header takes the first page */
+struct vgfb_ring *vgfb_ring_alloc(u32 slots, u32 slot_size)
+{
+	struct vgfb_ring *r;
+	struct vgfbm_ring *h;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return 0;
+	kref_init(&r->ref);
+	r->slots = slots;
+	r->slot_size = slot_size;
+	r->size = PAGE_SIZE + (size_t)slots * slot_size;
+	r->mem = vmalloc_user(r->size);
+	if (!r->mem) {
+		kfree(r);
+		return 0;
+	}
+	h = r->mem;
+	h->slots = slots;
+	h->slot_size = slot_size;
+	h->data_offset = PAGE_SIZE;
+	return r;
+}
+
+static void vgfb_ring_free(struct kref *ref)
+{
+	struct vgfb_ring *r = container_of(ref, struct vgfb_ring, ref);
+
+	vfree(r->mem);
+	kfree(r);
+}
+
+void vgfb_ring_put(struct vgfb_ring *r)
+{
+	kref_put(&r->ref, vgfb_ring_free);
+}
+
+/* The master owns tail, it may have written anything there */
+bool vgfb_ring_full(struct vgfb_ring *r)
+{
+	struct vgfbm_ring *h = r->mem;
+
+	return READ_ONCE(r->head) - smp_load_acquire(&h->tail) >= r->slots;
+}
+
+bool vgfb_ring_pending(struct vgfb_ring *r)
+{
+	struct vgfbm_ring *h = r->mem;
+
+	return READ_ONCE(r->head) != READ_ONCE(h->tail);
+}
+
+/*
+ * Copies slot and the lines of the frame it describes, starting at offset
+ * in e, into the next slot and publishes it. Fails with -ENOSPC if they
+ * don't fit a slot and -EBUSY while the ring is full.
+ */
+int vgfb_ring_push(struct vgfb_ring *r, struct vm_mem_entry *e,
+	const struct vgfbm_ring_slot *slot, unsigned long offset,
+	unsigned long line_length)
+{
+	u32 i, index;
+	char *dst;
+	struct vgfbm_ring *h = r->mem;
+
+	if ((u64)slot->stride * slot->rect.height
+	    > r->slot_size - slot->data_offset) {
+		r->dropped++;
+		WRITE_ONCE(h->dropped, r->dropped);
+		return -ENOSPC;
+	}
+	if (vgfb_ring_full(r))
+		return -EBUSY;
+
+	div_u64_rem(r->head, r->slots, &index);
+	dst = (char *)r->mem + PAGE_SIZE + (size_t)index * r->slot_size;
+	memcpy(dst, slot, sizeof(*slot));
+	for (i = 0; i < slot->rect.height; i++)
+		vgfb_mem_read(e, offset + i * line_length,
+			      dst + slot->data_offset + i * slot->stride,
+			      slot->stride);
+	WRITE_ONCE(r->head, r->head + 1);
+	smp_store_release(&h->head, r->head);
+	return 0;
+}
+
+static void vgfb_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct vgfb_ring *r = vma->vm_private_data;
+
+	kref_get(&r->ref);
+}
+
+static void vgfb_ring_vm_close(struct vm_area_struct *vma)
+{
+	vgfb_ring_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct vgfb_ring_vm_ops = {
+	.open = vgfb_ring_vm_open,
+	.close = vgfb_ring_vm_close,
+};
+
+/* Maps the ring starting at page pgoff of it */
+int vgfb_ring_mmap(struct vgfb_ring *r, struct vm_area_struct *vma,
+		unsigned long pgoff)
+{
+	int ret;
+
+	ret = remap_vmalloc_range(vma, r->mem, pgoff);
+	if (ret < 0)
+		return ret;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	kref_get(&r->ref);
+	vma->vm_private_data = r;
+	vma->vm_ops = &vgfb_ring_vm_ops;
+	return 0;
+}
+
+int __init vgfb_mem_init(void)
+{
+	vgfb_zero_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!vgfb_zero_page)
+		return -ENOMEM;
+	return 0;
+}
+
+void vgfb_mem_exit(void)
+{
+	int bkt;
+	struct hlist_node *tmp;
+	struct vgfb_dedup_page *d;
+
+	hash_for_each_safe(vgfb_dedup_pages, bkt, tmp, d, link) {
+		hash_del(&d->link);
+		if (d->page)
+			put_page(d->page);
+		kfree(d);
+	}
+	__free_page(vgfb_zero_page);
+}
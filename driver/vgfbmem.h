@@ -0,0 +1,90 @@
+#ifndef VGFBMEM_H
+#define VGFBMEM_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+#include <linux/kref.h>
+
+struct vgfbm;
+struct vm_mem_entry;
+struct vm_area_struct;
+struct iov_iter;
+struct page;
+struct vgfbm_ring_slot;
+
+/*
+ * Pages of screen memory frozen at one point in time. Writers copy
+ * frozen pages before touching them, so these stay as they were. NULL
+ * pages were never written.
+ */
+struct vgfb_snapshot {
+	struct kref ref;
+	struct vm_mem_entry *entry;
+	unsigned long first;
+	unsigned long npages;
+	struct page **pages;
+};
+
+/* Frame ring shared with the master, see struct vgfbm_ring */
+struct vgfb_ring {
+	struct kref ref;
+	void *mem;
+	size_t size;
+	u32 slots;
+	u32 slot_size;
+	u64 head;
+	u64 dropped;
+};
+
+struct vm_mem_entry *vgfb_mem_alloc(struct vgfbm *fb, size_t size);
+void vgfb_mem_free(struct vm_mem_entry *e);
+int vgfb_mem_mmap(struct vm_mem_entry *e, struct vm_area_struct *vma);
+
+bool vgfb_acquire_screen_memory(struct vm_mem_entry *e);
+void vgfb_release_screen_memory(struct vm_mem_entry *e);
+
+void vgfb_mem_read(struct vm_mem_entry *e, unsigned long offset,
+	void *buf, size_t len);
+size_t vgfb_mem_write(struct vm_mem_entry *e, unsigned long offset,
+	const void *buf, size_t len, gfp_t gfp);
+bool vgfb_mem_fill(struct vm_mem_entry *e, unsigned long offset, u32 color,
+	size_t count, bool xor, gfp_t gfp);
+bool vgfb_mem_move(struct vm_mem_entry *e, unsigned long dst,
+	unsigned long src, size_t len, gfp_t gfp);
+
+int vgfb_mem_to_user(struct vm_mem_entry *e, unsigned long offset,
+	void __user *buf, size_t len);
+int vgfb_mem_from_user(struct vm_mem_entry *e, unsigned long offset,
+	const void __user *buf, size_t len);
+size_t vgfb_mem_to_iter(struct vm_mem_entry *e, unsigned long offset,
+	size_t len, struct iov_iter *to);
+size_t vgfb_mem_from_iter(struct vm_mem_entry *e, unsigned long offset,
+	size_t len, struct iov_iter *from);
+
+unsigned long vgfb_mem_reclaim(struct vm_mem_entry *e);
+unsigned long vgfb_mem_dedup(struct vm_mem_entry *e);
+void vgfb_mem_dedup_end(void);
+
+struct vgfb_snapshot *vgfb_mem_snapshot(struct vm_mem_entry *e,
+	unsigned long first, unsigned long last);
+void vgfb_snapshot_put(struct vgfb_snapshot *s);
+int vgfb_snapshot_mmap(struct vgfb_snapshot *s, struct vm_area_struct *vma,
+	unsigned long pgoff);
+
+struct vgfb_ring *vgfb_ring_alloc(u32 slots, u32 slot_size);
+void vgfb_ring_put(struct vgfb_ring *r);
+bool vgfb_ring_full(struct vgfb_ring *r);
+bool vgfb_ring_pending(struct vgfb_ring *r);
+int vgfb_ring_push(struct vgfb_ring *r, struct vm_mem_entry *e,
+	const struct vgfbm_ring_slot *slot, unsigned long offset,
+	unsigned long line_length);
+int vgfb_ring_mmap(struct vgfb_ring *r, struct vm_area_struct *vma,
+	unsigned long pgoff);
+
+void vgfb_zap_mappings(struct vgfbm *fb, unsigned long first,
+	unsigned long last);
+
+int vgfb_mem_init(void);
+void vgfb_mem_exit(void);
+
+#endif
@@ -0,0 +1,259 @@
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include "vgfbmo.h"
+#include "vgfbmx.h"
+#include "vgfb.h"
+#include "vg.h"
+
+/*
+ * /dev/vgfbmo, read only handles to devices of other masters. Each open
+ * file is a struct vgfbm_observer, attached to a device by VGFBM_OBSERVE.
+ */
+
+struct vgfbmo {
+	dev_t dev;
+	struct cdev *cdev;
+	struct device *device;
+	struct class *class;
+};
+
+static struct vgfbmo vgfbmo;
+
+static int vgfbmo_open(struct inode *inode, struct file *file)
+{
+	struct vgfbm_observer *obs;
+
+	obs = kzalloc(sizeof(*obs), GFP_KERNEL);
+	if (!obs)
+		return -ENOMEM;
+	mutex_init(&obs->lock);
+	INIT_LIST_HEAD(&obs->list);
+	file->private_data = obs;
+	return 0;
+}
+
+static int vgfbmo_close(struct inode *inode, struct file *file)
+{
+	struct vgfbm_observer *obs = file->private_data;
+	struct vgfbm *fb = obs->fb;
+
+	if (fb) {
+		spin_lock_irq(&fb->state_lock);
+		list_del(&obs->list);
+		spin_unlock_irq(&fb->state_lock);
+		vgfbm_release(fb);
+	}
+	kfree(obs);
+	return 0;
+}
+
+static int vgfbmo_observe(struct file *file, const __u32 __user *arg)
+{
+	struct vgfbm_observer *obs = file->private_data;
+	int ret = 0;
+	u32 minor;
+	struct vgfbm *fb;
+	struct fb_info *info;
+
+	if (copy_from_user(&minor, arg, sizeof(minor)))
+		return -EFAULT;
+
+	fb = vgfbm_find(minor);
+	if (!fb)
+		return -ENODEV;
+	info = vgfbm_get_existing_info(fb);
+	if (!info) {
+		vgfbm_release(fb);
+		return -ENODEV;
+	}
+
+	mutex_lock(&obs->lock);
+	if (obs->fb) {
+		ret = -EBUSY;
+		goto end;
+	}
+	/* Everything is new to a new observer */
+	mutex_lock(&fb->lock);
+	spin_lock_irq(&fb->state_lock);
+	obs->damage = (struct vgfb_damage){ 0, 0, info->var.xres_virtual,
+					    info->var.yres_virtual };
+	obs->frame_seq = fb->frame_seq - 1;
+	list_add_tail(&obs->list, &fb->observers);
+	spin_unlock_irq(&fb->state_lock);
+	mutex_unlock(&fb->lock);
+	/* Nothing can be mapped before this, mmap needs obs->fb */
+	file->f_mapping = &fb->mapping;
+	smp_store_release(&obs->fb, fb);
+end:
+	mutex_unlock(&obs->lock);
+	vgfbm_put_info(info);
+	if (ret < 0)
+		vgfbm_release(fb);
+	return ret;
+}
+
+static long vgfbmo_ioctl(struct file *file, unsigned int cmd,
+	unsigned long arg)
+{
+	int ret, tmp;
+	void __user *argp = (void __user *)arg;
+	struct vgfbm_observer *obs = file->private_data;
+	struct vgfbm *fb;
+	struct fb_info *info;
+
+	if (cmd == VGFBM_OBSERVE)
+		return vgfbmo_observe(file, argp);
+
+	fb = READ_ONCE(obs->fb);
+	if (!fb)
+		return -ENODEV;
+	info = vgfbm_get_existing_info(fb);
+	if (!info)
+		return -ENODEV;
+
+	switch (cmd) {
+	case FBIOGET_VSCREENINFO:
+		ret = vgfbm_get_vscreeninfo_user(info, argp);
+		break;
+	case FBIOGET_FSCREENINFO:
+		ret = vgfbm_get_fscreeninfo_user(info, argp);
+		break;
+	case VGFBM_GET_FB_MINOR:
+		tmp = info->node;
+		ret = copy_to_user(argp, &tmp, sizeof(int)) ? -EFAULT : 0;
+		break;
+	case VGFBM_READ_RECTS:
+		ret = vgfbm_rects_user(info, argp, false);
+		break;
+	case VGFBM_GET_FRAME_STATE:
+		ret = vgfbm_get_frame_state_user(info, argp, obs);
+		break;
+	case VGFBM_READ_THUMBNAIL:
+		ret = vgfbm_read_thumbnail_user(info, argp, true);
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+
+	vgfbm_put_info(info);
+	return ret;
+}
+
+/*
+ * Readable when there are frames this observer hasn't seen, priority on
+ * its damage, hung up once the master closed the device.
+ */
+static __poll_t vgfbmo_poll(struct file *file, poll_table *wait)
+{
+	__poll_t mask = 0;
+	struct vgfbm_observer *obs = file->private_data;
+	struct vgfbm *fb = READ_ONCE(obs->fb);
+
+	if (!fb)
+		return EPOLLERR;
+
+	poll_wait(file, &fb->wait, wait);
+
+	spin_lock_irq(&fb->state_lock);
+	if (fb->frame_seq != obs->frame_seq)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (obs->damage.x1 < obs->damage.x2 && obs->damage.y1 < obs->damage.y2)
+		mask |= EPOLLPRI;
+	spin_unlock_irq(&fb->state_lock);
+	if (!READ_ONCE(fb->info))
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+static int vgfbmo_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int ret;
+	struct vgfbm_observer *obs = file->private_data;
+	/* Pairs with vgfbmo_observe, so f_mapping is already the device's */
+	struct vgfbm *fb = smp_load_acquire(&obs->fb);
+	struct fb_info *info;
+
+	if (!fb)
+		return -ENODEV;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	if (vma->vm_pgoff == VGFBM_MMAP_STATUS >> PAGE_SHIFT)
+		return vgfbm_status_mmap(fb, vma);
+	if (vma->vm_pgoff >= VGFBM_MMAP_STATUS >> PAGE_SHIFT)
+		return -EINVAL;
+
+	info = vgfbm_get_existing_info(fb);
+	if (!info)
+		return -ENODEV;
+	if (!lock_fb_info(info)) {
+		ret = -ENODEV;
+		goto end;
+	}
+	ret = vgfb_mmap(info, vma);
+	unlock_fb_info(info);
+end:
+	vgfbm_put_info(info);
+	return ret;
+}
+
+static const struct file_operations vgfbmo_opts = {
+	.owner = THIS_MODULE,
+	.open = vgfbmo_open,
+	.release = vgfbmo_close,
+	.unlocked_ioctl = vgfbmo_ioctl,
+	.poll = vgfbmo_poll,
+	.mmap = vgfbmo_mmap,
+};
+
+int vgfbmo_init(struct class *class, dev_t dev)
+{
+	int ret;
+
+	vgfbmo.dev = dev;
+	vgfbmo.class = class;
+
+	vgfbmo.cdev = cdev_alloc();
+	if (!vgfbmo.cdev) {
+		pr_err("vgfbmo: Failed to allocate cdev\n");
+		return -ENOMEM;
+	}
+	vgfbmo.cdev->ops = &vgfbmo_opts;
+	vgfbmo.cdev->owner = THIS_MODULE;
+
+	vgfbmo.device = device_create(class, 0, dev, 0, "vgfbmo");
+	if (IS_ERR(vgfbmo.device)) {
+		pr_err("vgfbmo: Failed to create device\n");
+		ret = PTR_ERR(vgfbmo.device);
+		goto failed_after_cdev_alloc;
+	}
+
+	ret = cdev_add(vgfbmo.cdev, dev, 1);
+	if (ret) {
+		pr_err("vgfbmo: Failed to add cdev\n");
+		goto failed_after_device_create;
+	}
+
+	return 0;
+
+failed_after_device_create:
+	device_destroy(class, dev);
+failed_after_cdev_alloc:
+	cdev_del(vgfbmo.cdev);
+	return ret;
+}
+
+void vgfbmo_exit(void)
+{
+	cdev_del(vgfbmo.cdev);
+	device_destroy(vgfbmo.class, vgfbmo.dev);
+}
@@ -0,0 +1,11 @@
+#ifndef VGFBMO_H
+#define VGFBMO_H
+
+#include <linux/types.h>
+
+struct class;
+
+int vgfbmo_init(struct class *class, dev_t dev);
+void vgfbmo_exit(void);
+
+#endif
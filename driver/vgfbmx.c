@@ -9,7 +9,18 @@
 #include <linux/slab.h>
 #include <linux/mm.h>
 #include <linux/fs.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/nodemask.h>
+#include <linux/log2.h>
+#include <linux/eventfd.h>
+#include <linux/workqueue.h>
 #include "vgfbmx.h"
+#include "vgfbmem.h"
+#include "vgfbmo.h"
 #include "vgfb.h"
 #include "vg.h"
 
@@ -17,6 +28,51 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Daniel Patrick Abrecht");
 MODULE_DESCRIPTION("Virtual graphics frame buffer driver, allows to dynamically allocate framebuffer devices. This is intended to allow container hypervisors to provide virtual displays to it's containers on the fly.");
 
+static unsigned int alloc_policy = VGFBM_ALLOC_DMA32;
+module_param(alloc_policy, uint, 0644);
+MODULE_PARM_DESC(alloc_policy, "Default screen memory allocation policy (0: 32-bit addressable pages, 1: any zone)");
+
+static bool sparse;
+module_param(sparse, bool, 0644);
+MODULE_PARM_DESC(sparse, "Allocate screen memory pages on first write by default");
+
+static unsigned int reclaim_timeout_ms;
+module_param(reclaim_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(reclaim_timeout_ms, "Default time in ms after which screen memory of devices the master doesn't read is reclaimed, 0 to disable");
+
+static unsigned int pitch_align;
+module_param(pitch_align, uint, 0644);
+MODULE_PARM_DESC(pitch_align, "Default alignment of lines in bytes, a power of two up to 4096, 0 for none");
+
+static void vgfbm_dedup(struct work_struct *work);
+static DECLARE_DELAYED_WORK(vgfbm_dedup_work, vgfbm_dedup);
+/* Whether the scan may be queued, the module isn't loading or unloading */
+static bool vgfbm_dedup_ready;
+static DEFINE_MUTEX(vgfbm_dedup_lock);
+
+static unsigned int dedup_interval_ms;
+
+static int dedup_interval_ms_set(const char *val,
+	const struct kernel_param *kp)
+{
+	int ret;
+
+	ret = param_set_uint(val, kp);
+	mutex_lock(&vgfbm_dedup_lock);
+	if (!ret && vgfbm_dedup_ready && READ_ONCE(dedup_interval_ms))
+		mod_delayed_work(system_unbound_wq, &vgfbm_dedup_work, 0);
+	mutex_unlock(&vgfbm_dedup_lock);
+	return ret;
+}
+
+static const struct kernel_param_ops dedup_interval_ms_ops = {
+	.set = dedup_interval_ms_set,
+	.get = param_get_uint,
+};
+module_param_cb(dedup_interval_ms, &dedup_interval_ms_ops, &dedup_interval_ms,
+		0644);
+MODULE_PARM_DESC(dedup_interval_ms, "Time in ms between scans sharing identical screen pages between all devices, 0 to disable");
+
 struct vgfbmx {
 	int major;
 	dev_t dev;
@@ -28,14 +84,23 @@ struct vgfbmx {
 
 static struct vgfbmx vgfbmx;
 
+/* Created devices, for observers to find them */
+static LIST_HEAD(vgfbm_list);
+static DEFINE_MUTEX(vgfbm_list_lock);
+
+/* Devices closed by their master are torn down here, in parallel */
+static struct workqueue_struct *vgfbm_remove_wq;
+
 bool vgfbm_acquire(struct vgfbm *vgfbm)
 {
 	unsigned long val;
 
 	mutex_lock(&vgfbm->count_lock);
 	val = vgfbm->count + 1;
-	if (!val)
+	if (!val) {
+		mutex_unlock(&vgfbm->count_lock);
 		return false;
+	}
 	vgfbm->count = val;
 	mutex_unlock(&vgfbm->count_lock);
 	return true;
@@ -61,10 +126,96 @@ void vgfbm_release(struct vgfbm *vgfbm)
 	}
 	vgfb_free(vgfbm);
 	mutex_unlock(&vgfbm->count_lock);
+	vfree(vgfbm->status);
 	kfree(vgfbm);
 }
 
+/* The master looked at the device, which holds off reclaim */
+static void vgfbm_watched(struct vgfbm *vgfbm)
+{
+	WRITE_ONCE(vgfbm->last_watched, jiffies);
+}
+
+static bool vgfbm_pitch_align_valid(u32 align)
+{
+	return !align || (is_power_of_2(align) && align <= VGFBM_MAX_PITCH_ALIGN);
+}
+
+/* Bytes per line of xres pixels */
+static u64 vgfbm_pitch(u32 xres, u32 align)
+{
+	u64 pitch = (u64)xres * 4;
+
+	if (align)
+		pitch = ALIGN(pitch, (u64)align);
+	return pitch;
+}
+
+/*
+ * Creates the framebuffer device unless it exists already. With params,
+ * it's created with those and must not exist yet.
+ */
+static int vgfbm_create(struct vgfbm *vgfbm,
+	const struct vgfbm_create *params)
+{
+	int ret = 0;
+
+	mutex_lock(&vgfbm->create_lock);
+	if (vgfbm->created) {
+		if (params)
+			ret = -EBUSY;
+		goto end;
+	}
+	if (params) {
+		vgfbm->initial_resolution[0] = params->xres;
+		vgfbm->initial_resolution[1] = params->yres;
+		vgfbm->buffers = params->buffers;
+		vgfbm->refresh_rate = params->refresh_rate;
+		vgfbm->pitch_align = params->pitch_align;
+		if (params->flags & VGFBM_CREATE_ALLOC_POLICY) {
+			vgfbm->alloc_policy = params->alloc.policy;
+			vgfbm->alloc_node = params->alloc.node;
+			vgfbm->alloc_flags = params->alloc.flags;
+		}
+	}
+	ret = vgfb_create(vgfbm);
+	if (ret < 0)
+		goto end;
+	vgfbm->created = true;
+	mutex_lock(&vgfbm_list_lock);
+	list_add_tail(&vgfbm->list, &vgfbm_list);
+	mutex_unlock(&vgfbm_list_lock);
+	if (vgfbm->reclaim_timeout_ms)
+		schedule_delayed_work(&vgfbm->reclaim_work,
+			msecs_to_jiffies(vgfbm->reclaim_timeout_ms));
+end:
+	mutex_unlock(&vgfbm->create_lock);
+	return ret;
+}
+
+static int vgfbm_alloc_policy_valid(const struct vgfbm_alloc_policy *policy)
+{
+	if (policy->policy > VGFBM_ALLOC_ANY)
+		return -EINVAL;
+	if (policy->flags & ~VGFBM_ALLOC_SPARSE || policy->reserved)
+		return -EINVAL;
+	if (policy->node != NUMA_NO_NODE
+	 && (policy->node < 0 || policy->node >= nr_node_ids
+	  || !node_online(policy->node)))
+		return -EINVAL;
+	return 0;
+}
+
+/* Gets the fb_info, creating the device with defaults if necessary */
 struct fb_info *vgfbm_get_info(struct vgfbm *vgfbm)
+{
+	if (vgfbm_create(vgfbm, 0) < 0)
+		return 0;
+	return vgfbm_get_existing_info(vgfbm);
+}
+
+/* Like vgfbm_get_info, without creating the device */
+struct fb_info *vgfbm_get_existing_info(struct vgfbm *vgfbm)
 {
 	struct fb_info *info;
 
@@ -76,6 +227,25 @@ struct fb_info *vgfbm_get_info(struct vgfbm *vgfbm)
 	return info;
 }
 
+/* Finds and acquires the device whose framebuffer has the given minor */
+struct vgfbm *vgfbm_find(int minor)
+{
+	struct vgfbm *vgfbm, *found = 0;
+
+	mutex_lock(&vgfbm_list_lock);
+	list_for_each_entry(vgfbm, &vgfbm_list, list) {
+		mutex_lock(&vgfbm->info_lock);
+		if (vgfbm->info && vgfbm->info->node == minor
+		 && vgfbm_acquire(vgfbm))
+			found = vgfbm;
+		mutex_unlock(&vgfbm->info_lock);
+		if (found)
+			break;
+	}
+	mutex_unlock(&vgfbm_list_lock);
+	return found;
+}
+
 void vgfbm_put_info(struct fb_info *info)
 {
 	if (!atomic_dec_and_test(&info->count))
@@ -87,6 +257,7 @@ void vgfbm_put_info(struct fb_info *info)
 int vgfbmx_open(struct inode *inode, struct file *file)
 {
 	int ret = 0;
+	u32 align;
 	struct vgfbm *vgfbm;
 
 	pr_info("vgfbmx: device opened\n");
@@ -98,16 +269,41 @@ int vgfbmx_open(struct inode *inode, struct file *file)
 	mutex_init(&vgfbm->lock);
 	mutex_init(&vgfbm->info_lock);
 	mutex_init(&vgfbm->count_lock);
+	mutex_init(&vgfbm->create_lock);
+	address_space_init_once(&vgfbm->mapping);
+	mutex_init(&vgfbm->mapping_lock);
+	INIT_LIST_HEAD(&vgfbm->mappings);
+	INIT_LIST_HEAD(&vgfbm->observers);
+	spin_lock_init(&vgfbm->state_lock);
+	init_waitqueue_head(&vgfbm->wait);
+	vgfbm->pacing_timeout_ms = VGFB_PACING_TIMEOUT_MS;
+	vgfbm->refresh_rate = VGFB_REFRESH_RATE;
+	vgfbm->alloc_policy = READ_ONCE(alloc_policy);
+	vgfbm->alloc_flags = READ_ONCE(sparse) ? VGFBM_ALLOC_SPARSE : 0;
+	vgfbm->alloc_node = NUMA_NO_NODE;
+	vgfbm->reclaim_timeout_ms = READ_ONCE(reclaim_timeout_ms);
+	vgfbm->last_watched = jiffies;
+	INIT_DELAYED_WORK(&vgfbm->reclaim_work, vgfb_reclaim_work);
+	vgfbm->idle_timeout_ms = VGFB_IDLE_TIMEOUT_MS;
+	INIT_DELAYED_WORK(&vgfbm->idle_work, vgfb_idle_work);
+	INIT_DELAYED_WORK(&vgfbm->ring_work, vgfb_ring_work);
+	INIT_WORK(&vgfbm->remove_work, vgfbm_remove_work);
+	vgfbm->initial_resolution[0] = VGFB_XRES;
+	vgfbm->initial_resolution[1] = VGFB_YRES;
+	vgfbm->buffers = VGFB_BUFFERS;
+	align = READ_ONCE(pitch_align);
+	vgfbm->pitch_align = vgfbm_pitch_align_valid(align) ? align : 0;
+
+	vgfbm->status = vmalloc_user(PAGE_SIZE);
+	if (!vgfbm->status) {
+		kfree(vgfbm);
+		return -ENOMEM;
+	}
 
 	file->private_data = vgfbm;
+	file->f_mapping = &vgfbm->mapping;
 	vgfbm_acquire(vgfbm);
 
-	ret = vgfb_create(vgfbm);
-	if (ret < 0) {
-		vgfbm_release(vgfbm);
-		return ret;
-	}
-
 	return 0;
 }
 
@@ -124,6 +320,7 @@ ssize_t vgfbmx_read(struct file *file, char __user *buf, size_t count,
 		goto end;
 	}
 
+	vgfbm_watched(file->private_data);
 	ret = vgfb_read(info, buf, count, ppos);
 	unlock_fb_info(info);
 
@@ -153,17 +350,150 @@ end:
 	return ret;
 }
 
+ssize_t vgfbmx_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+	struct fb_info *info = vgfbm_get_info(iocb->ki_filp->private_data);
+
+	if (!info)
+		return -ENODEV;
+	if (!lock_fb_info(info)) {
+		ret = -ENODEV;
+		goto end;
+	}
+
+	vgfbm_watched(iocb->ki_filp->private_data);
+	ret = vgfb_read_iter(info, iocb, to);
+	unlock_fb_info(info);
+
+end:
+	vgfbm_put_info(info);
+	return ret;
+}
+
+ssize_t vgfbmx_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t ret;
+	struct fb_info *info = vgfbm_get_info(iocb->ki_filp->private_data);
+
+	if (!info)
+		return -ENODEV;
+	if (!lock_fb_info(info)) {
+		ret = -ENODEV;
+		goto end;
+	}
+
+	ret = vgfb_write_iter(info, iocb, from);
+	unlock_fb_info(info);
+
+end:
+	vgfbm_put_info(info);
+	return ret;
+}
+
+/*
+ * Scans the screen memory of every device for pages it can share with
+ * others, and reruns every dedup_interval_ms while that isn't 0.
+ */
+static void vgfbm_dedup(struct work_struct *work)
+{
+	struct vgfbm *vgfbm, **devices;
+	unsigned long i, n = 0, count = 0, freed = 0;
+	unsigned int interval = READ_ONCE(dedup_interval_ms);
+
+	if (!interval)
+		return;
+
+	mutex_lock(&vgfbm_list_lock);
+	list_for_each_entry(vgfbm, &vgfbm_list, list)
+		count++;
+	devices = kmalloc_array(count, sizeof(*devices), GFP_KERNEL);
+	if (devices)
+		list_for_each_entry(vgfbm, &vgfbm_list, list)
+			if (vgfbm_acquire(vgfbm))
+				devices[n++] = vgfbm;
+	mutex_unlock(&vgfbm_list_lock);
+
+	for (i = 0; i < n; i++) {
+		freed += vgfb_dedup(devices[i]);
+		vgfbm_release(devices[i]);
+	}
+	kfree(devices);
+	vgfb_mem_dedup_end();
+	if (freed)
+		pr_debug("vgfbmx: dedup freed %lu pages\n", freed);
+
+	queue_delayed_work(system_unbound_wq, &vgfbm_dedup_work,
+			   msecs_to_jiffies(interval));
+}
+
+/* Signals the remove event and drops the reference of the master */
+static void vgfbm_removed(struct vgfbm *vgfbm)
+{
+	if (vgfbm->remove_event) {
+		eventfd_signal(vgfbm->remove_event, 1);
+		eventfd_ctx_put(vgfbm->remove_event);
+		vgfbm->remove_event = NULL;
+	}
+	vgfbm_release(vgfbm);
+}
+
+void vgfbm_remove_work(struct work_struct *work)
+{
+	struct vgfbm *vgfbm = container_of(work, struct vgfbm, remove_work);
+
+	vgfb_remove(vgfbm);
+	/* Observers hang up */
+	wake_up(&vgfbm->wait);
+	vgfbm_removed(vgfbm);
+}
+
 int vgfbmx_close(struct inode *inode, struct file *file)
 {
 	struct vgfbm *vgfbm = file->private_data;
 
-	vgfb_remove(vgfbm);
-	vgfbm_release(vgfbm);
+	if (vgfbm->created) {
+		mutex_lock(&vgfbm_list_lock);
+		list_del(&vgfbm->list);
+		mutex_unlock(&vgfbm_list_lock);
+		/*
+		 * Unregistering the framebuffer goes through fbcon and the
+		 * driver core, which is slow. Guest mappings of the screen
+		 * memory hold the device through their vm_mem_entry.
+		 */
+		queue_work(vgfbm_remove_wq, &vgfbm->remove_work);
+	} else {
+		vgfbm_removed(vgfbm);
+	}
 
 	pr_info("vgfbmx: device closed\n");
 	return 0;
 }
 
+int vgfbm_set_remove_event_user(struct vgfbm *vgfbm, const __s32 __user *arg)
+{
+	s32 fd;
+	struct eventfd_ctx *event = NULL, *old;
+
+	if (copy_from_user(&fd, arg, sizeof(fd)))
+		return -EFAULT;
+
+	if (fd >= 0) {
+		event = eventfd_ctx_fdget(fd);
+		if (IS_ERR(event))
+			return PTR_ERR(event);
+	}
+
+	mutex_lock(&vgfbm->create_lock);
+	old = vgfbm->remove_event;
+	vgfbm->remove_event = event;
+	mutex_unlock(&vgfbm->create_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
 int vgfbm_get_vscreeninfo_user(const struct fb_info *info,
 	struct fb_var_screeninfo __user *var)
 {
@@ -175,10 +505,16 @@ int vgfbm_get_vscreeninfo_user(const struct fb_info *info,
 	return 0;
 }
 
+static u32 vgfbm_pixclock(u32 xres, u32 yres, u32 refresh_rate)
+{
+	return div64_u64(1000000000000ull, (u64)xres * yres * refresh_rate);
+}
+
 int vgfbm_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
 {
 	struct fb_videomode *mode;
 	struct fb_var_screeninfo tmp = *var;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
 
 	if (tmp.bits_per_pixel != 32)
 		return -EINVAL;
@@ -189,6 +525,11 @@ int vgfbm_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
 	if (tmp.yoffset > tmp.yres)
 		return -EINVAL;
 
+	if (!tmp.xres || !tmp.yres
+	 || vgfbm_pitch(tmp.xres, fb->pitch_align) * tmp.yres * fb->buffers
+		> VGFBM_MMAP_STATUS)
+		return -EINVAL;
+
 	mode = &list_entry(info->modelist.next, struct fb_modelist, list)
 		->mode;
 
@@ -201,11 +542,10 @@ int vgfbm_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
 	var->xres = tmp.xres;
 	var->yres = tmp.yres;
 	var->xres_virtual = tmp.xres;
-	var->yres_virtual = tmp.yres * 2;
+	var->yres_virtual = tmp.yres * fb->buffers;
 	var->xoffset = tmp.xoffset;
 	var->yoffset = tmp.yoffset;
-	var->pixclock = 1000000000000lu / var->xres
-			/ var->yres / VGFB_REFRESH_RATE;
+	var->pixclock = vgfbm_pixclock(var->xres, var->yres, fb->refresh_rate);
 
 	if (var->bits_per_pixel == 32) {
 		var->red    = (struct fb_bitfield){ 0, 8, 0};
@@ -232,8 +572,8 @@ int vgfbm_set_par(struct fb_info *info)
 int vgfbm_do_set_par(struct fb_info *info)
 {
 	int ret;
-	size_t size, size_aligned;
-	void *mem;
+	size_t size;
+	u64 pitch;
 	struct fb_videomode *mode;
 	struct vgfbm *fb = *(struct vgfbm **)info->par;
 	struct fb_event event;
@@ -242,35 +582,33 @@ int vgfbm_do_set_par(struct fb_info *info)
 		->mode;
 
 	fb_var_to_videomode(mode, &info->var);
-	mode->refresh = VGFB_REFRESH_RATE;
+	mode->refresh = fb->refresh_rate;
+
+	pitch = vgfbm_pitch(info->var.xres_virtual, fb->pitch_align);
 
 	if (fb->videomode.xres == mode->xres
-	 && fb->videomode.yres == mode->yres)
+	 && fb->videomode.yres == mode->yres
+	 && info->fix.line_length == pitch)
 		goto end;
 
-	size = info->var.xres_virtual * info->var.yres_virtual * 4;
-	size_aligned = PAGE_ALIGN(size);
+	size = pitch * info->var.yres_virtual;
 
-	mem = vmalloc_32_user(size_aligned);
-	if (!mem) {
-		pr_info("vgfbm: vmalloc_32_user failed\n");
-		ret = -ENOMEM;
-		goto failed;
-	}
-	pr_debug("vgfbm: allocated screen memory %p\n", mem);
-
-	ret = vgfb_set_screenbase(fb, mem);
+	ret = vgfb_realloc_screen(fb, size);
 	if (ret < 0) {
-		pr_info("vgfbm: vgfb_set_screenbase failed\n");
-		vfree(mem);
+		pr_info("vgfbm: vgfb_realloc_screen failed\n");
 		goto failed;
 	}
 
 	info->fix.ypanstep = info->var.yres_virtual - info->var.yres;
 	info->fix.smem_start = 0;
-	info->fix.smem_len = info->var.xres_virtual
-				* info->var.yres_virtual * 4;
-	info->fix.line_length = info->var.xres_virtual * 4;
+	info->fix.smem_len = size;
+	info->fix.line_length = pitch;
+
+	spin_lock_irq(&fb->state_lock);
+	fb->generation++;
+	vgfb_damage_all(fb, info);
+	vgfb_status_write(fb, info);
+	spin_unlock_irq(&fb->state_lock);
 
 	info->state = FBINFO_STATE_RUNNING;
 	event.info = info;
@@ -293,22 +631,17 @@ int vgfbm_set_vscreeninfo_user(struct fb_info *info,
 	struct fb_var_screeninfo __user *var)
 {
 	int ret;
+	bool console;
 	struct fb_var_screeninfo v;
 	struct vgfbm *fb = *(struct vgfbm **)info->par;
 
 	if (copy_from_user(&v, var, sizeof(v)))
 		return -EFAULT;
 
-	console_lock();
-	if (!lock_fb_info(info)) {
-		console_unlock();
+	if (!vgfb_lock(fb, info, &console))
 		return -ENODEV;
-	}
-	mutex_lock(&fb->lock);
 	ret = vgfbm_set_vscreeninfo(info, &v);
-	mutex_unlock(&fb->lock);
-	unlock_fb_info(info);
-	console_unlock();
+	vgfb_unlock(fb, info, console);
 
 	if (ret < 0)
 		return ret;
@@ -340,11 +673,11 @@ int vgfbm_set_resolution(struct fb_info *info,
 			const unsigned long resolution[2])
 {
 	struct fb_var_screeninfo var = info->var;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
 
 	var.xres = resolution[0];
 	var.yres = resolution[1];
-	var.pixclock = 1000000000000lu / var.xres
-			/ var.yres / VGFB_REFRESH_RATE;
+	var.pixclock = vgfbm_pixclock(var.xres, var.yres, fb->refresh_rate);
 
 	return vgfbm_set_vscreeninfo(info, &var);
 }
@@ -353,19 +686,17 @@ int vgfbm_pan_display(struct fb_info *info,
 	const struct fb_var_screeninfo __user *var)
 {
 	int ret;
+	bool console;
 	struct fb_var_screeninfo v;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
 
 	if (copy_from_user(&v, var, sizeof(v)))
 		return -EFAULT;
 
-	console_lock();
-	if (!lock_fb_info(info)) {
-		console_unlock();
+	if (!vgfb_lock(fb, info, &console))
 		return -ENODEV;
-	}
 	ret = vgfb_pan_display(&v, info);
-	unlock_fb_info(info);
-	console_unlock();
+	vgfb_unlock(fb, info, console);
 	return ret;
 }
 
@@ -381,6 +712,509 @@ int vgfbm_get_fscreeninfo_user(const struct fb_info *info,
 	return 0;
 }
 
+int vgfbm_rects_user(struct fb_info *info,
+	const struct vgfbm_rects __user *arg, bool write)
+{
+	int ret;
+	struct vgfbm_rects r;
+	struct vgfbm_rect *rects;
+
+	if (copy_from_user(&r, arg, sizeof(r)))
+		return -EFAULT;
+	if (!r.count)
+		return 0;
+	if (r.count > VGFBM_MAX_RECTS)
+		return -EINVAL;
+
+	rects = kvmalloc_array(r.count, sizeof(*rects), GFP_KERNEL);
+	if (!rects)
+		return -ENOMEM;
+	if (copy_from_user(rects, u64_to_user_ptr(r.rects),
+			   r.count * sizeof(*rects))) {
+		ret = -EFAULT;
+		goto end;
+	}
+
+	if (!lock_fb_info(info)) {
+		ret = -ENODEV;
+		goto end;
+	}
+	ret = vgfb_rects_io(info, rects, r.count, u64_to_user_ptr(r.buffer),
+			    r.buffer_size, r.stride, write);
+	unlock_fb_info(info);
+
+end:
+	kvfree(rects);
+	return ret;
+}
+
+/* Takes the damage of obs if given, else the master's */
+int vgfbm_get_frame_state_user(struct fb_info *info,
+	struct vgfbm_frame_state __user *arg, struct vgfbm_observer *obs)
+{
+	struct vgfbm_frame_state state;
+	struct vgfb_damage damage;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	memset(&state, 0, sizeof(state));
+
+	if (!lock_fb_info(info))
+		return -ENODEV;
+	mutex_lock(&fb->lock);
+	state.var = info->var;
+	state.fix = info->fix;
+	spin_lock_irq(&fb->state_lock);
+	state.frame_seq = fb->frame_seq;
+	state.generation = fb->generation;
+	if (obs) {
+		damage = obs->damage;
+		obs->damage = (struct vgfb_damage){ 0 };
+		obs->frame_seq = fb->frame_seq;
+	} else {
+		damage = fb->damage;
+		fb->damage = (struct vgfb_damage){ 0 };
+		vgfb_status_write(fb, info);
+	}
+	spin_unlock_irq(&fb->state_lock);
+	mutex_unlock(&fb->lock);
+	unlock_fb_info(info);
+
+	if (damage.x1 < damage.x2 && damage.y1 < damage.y2) {
+		state.damage.x = damage.x1;
+		state.damage.y = damage.y1;
+		state.damage.width = damage.x2 - damage.x1;
+		state.damage.height = damage.y2 - damage.y1;
+	}
+
+	if (copy_to_user(arg, &state, sizeof(state)))
+		return -EFAULT;
+	return 0;
+}
+
+int vgfbm_ack_frame_user(struct fb_info *info, const __u64 __user *arg)
+{
+	u64 seq;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (copy_from_user(&seq, arg, sizeof(seq)))
+		return -EFAULT;
+
+	spin_lock_irq(&fb->state_lock);
+	if (seq > fb->frame_seq)
+		seq = fb->frame_seq;
+	if (seq > fb->acked_seq) {
+		fb->acked_seq = seq;
+		vgfb_status_write(fb, info);
+	}
+	spin_unlock_irq(&fb->state_lock);
+	wake_up(&fb->wait);
+	return 0;
+}
+
+int vgfbm_set_pacing_user(struct fb_info *info,
+	const struct vgfbm_pacing __user *arg)
+{
+	struct vgfbm_pacing pacing;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (copy_from_user(&pacing, arg, sizeof(pacing)))
+		return -EFAULT;
+	if (!pacing.timeout_ms)
+		pacing.timeout_ms = VGFB_PACING_TIMEOUT_MS;
+
+	WRITE_ONCE(fb->pacing_timeout_ms, pacing.timeout_ms);
+	WRITE_ONCE(fb->max_pending, pacing.max_pending);
+	wake_up(&fb->wait);
+	return 0;
+}
+
+int vgfbm_set_refresh_rate_user(struct fb_info *info,
+	const __u32 __user *arg)
+{
+	u32 rate;
+	struct fb_videomode *mode;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (get_user(rate, arg))
+		return -EFAULT;
+	if (!rate || rate > VGFB_MAX_REFRESH_RATE)
+		return -EINVAL;
+
+	if (!lock_fb_info(info))
+		return -ENODEV;
+	mutex_lock(&fb->lock);
+	info->var.pixclock = vgfbm_pixclock(info->var.xres, info->var.yres,
+					    rate);
+	fb->old_var.pixclock = info->var.pixclock;
+	mode = &list_entry(info->modelist.next, struct fb_modelist, list)
+		->mode;
+	mode->refresh = rate;
+	mode->pixclock = info->var.pixclock;
+	fb->videomode.refresh = rate;
+	fb->videomode.pixclock = info->var.pixclock;
+	spin_lock_irq(&fb->state_lock);
+	fb->refresh_rate = rate;
+	vgfb_status_write(fb, info);
+	spin_unlock_irq(&fb->state_lock);
+	mutex_unlock(&fb->lock);
+	unlock_fb_info(info);
+	return 0;
+}
+
+int vgfbm_set_alloc_policy_user(struct fb_info *info,
+	const struct vgfbm_alloc_policy __user *arg)
+{
+	struct vgfbm_alloc_policy policy;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (copy_from_user(&policy, arg, sizeof(policy)))
+		return -EFAULT;
+	if (vgfbm_alloc_policy_valid(&policy) < 0)
+		return -EINVAL;
+
+	mutex_lock(&fb->lock);
+	fb->alloc_policy = policy.policy;
+	fb->alloc_node = policy.node;
+	fb->alloc_flags = policy.flags;
+	mutex_unlock(&fb->lock);
+	return 0;
+}
+
+int vgfbm_set_pitch_align_user(struct fb_info *info,
+	const __u32 __user *arg)
+{
+	int ret = 0;
+	bool console;
+	u32 align, old;
+	u64 pitch;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (copy_from_user(&align, arg, sizeof(align)))
+		return -EFAULT;
+	if (!vgfbm_pitch_align_valid(align))
+		return -EINVAL;
+
+	if (!vgfb_lock(fb, info, &console))
+		return -ENODEV;
+	old = fb->pitch_align;
+	fb->pitch_align = align;
+	pitch = vgfbm_pitch(info->var.xres_virtual, align);
+	if (pitch * info->var.yres_virtual > VGFBM_MMAP_STATUS)
+		ret = -EINVAL;
+	else if (pitch != info->fix.line_length)
+		ret = vgfbm_do_set_par(info);
+	if (ret < 0)
+		fb->pitch_align = old;
+	vgfb_unlock(fb, info, console);
+	return ret;
+}
+
+int vgfbm_set_reclaim_timeout_user(struct fb_info *info,
+	const __u32 __user *arg)
+{
+	u32 timeout_ms;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (copy_from_user(&timeout_ms, arg, sizeof(timeout_ms)))
+		return -EFAULT;
+
+	WRITE_ONCE(fb->reclaim_timeout_ms, timeout_ms);
+	if (timeout_ms)
+		mod_delayed_work(system_wq, &fb->reclaim_work,
+				 msecs_to_jiffies(timeout_ms));
+	return 0;
+}
+
+int vgfbm_get_guest_state_user(struct fb_info *info,
+	struct vgfbm_guest_state __user *arg)
+{
+	struct vgfbm_guest_state g;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	spin_lock_irq(&fb->state_lock);
+	g.state = fb->guest_state;
+	g.users = fb->guest_users;
+	g.seq = fb->guest_seq;
+	g.idle_ms = jiffies_to_msecs(jiffies - fb->last_drawn);
+	fb->guest_read_seq = fb->guest_seq;
+	spin_unlock_irq(&fb->state_lock);
+
+	if (copy_to_user(arg, &g, sizeof(g)))
+		return -EFAULT;
+	return 0;
+}
+
+int vgfbm_set_idle_timeout_user(struct fb_info *info,
+	const __u32 __user *arg)
+{
+	u32 timeout_ms;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (copy_from_user(&timeout_ms, arg, sizeof(timeout_ms)))
+		return -EFAULT;
+
+	spin_lock_irq(&fb->state_lock);
+	fb->idle_timeout_ms = timeout_ms;
+	spin_unlock_irq(&fb->state_lock);
+	/* Let it recheck with the new timeout, it turns idle from there */
+	if (timeout_ms)
+		mod_delayed_work(system_wq, &fb->idle_work, 0);
+	return 0;
+}
+
+int vgfbm_set_ring_user(struct fb_info *info,
+	struct vgfbm_ring_setup __user *arg)
+{
+	int ret;
+	struct vgfbm_ring_setup setup;
+
+	if (copy_from_user(&setup, arg, sizeof(setup)))
+		return -EFAULT;
+
+	if (!lock_fb_info(info))
+		return -ENODEV;
+	ret = vgfb_set_ring(info, &setup);
+	unlock_fb_info(info);
+
+	if (ret < 0)
+		return ret;
+
+	if (copy_to_user(arg, &setup, sizeof(setup)))
+		return -EFAULT;
+
+	return 0;
+}
+
+int vgfbm_set_command_log_user(struct fb_info *info,
+	const __u32 __user *arg)
+{
+	u32 enable;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (copy_from_user(&enable, arg, sizeof(enable)))
+		return -EFAULT;
+	if (enable > 1)
+		return -EINVAL;
+
+	if (!lock_fb_info(info))
+		return -ENODEV;
+	spin_lock_irq(&fb->state_lock);
+	/* The master knows nothing yet, so it starts out with everything */
+	if (enable && !fb->command_log.enable)
+		vgfb_command_log_reset(fb, info);
+	fb->command_log.enable = enable;
+	fb->command_log.overflow = false;
+	spin_unlock_irq(&fb->state_lock);
+	unlock_fb_info(info);
+
+	return 0;
+}
+
+int vgfbm_read_commands_user(struct fb_info *info,
+	struct vgfbm_commands __user *arg)
+{
+	int ret = 0;
+	u32 i, n;
+	struct vgfbm_commands c;
+	struct vgfbm_command *commands = NULL;
+	struct vgfb_damage damage = { 0 };
+	struct vgfb_command_log *log;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (copy_from_user(&c, arg, sizeof(c)))
+		return -EFAULT;
+
+	n = min_t(u32, c.count, VGFBM_MAX_COMMANDS);
+	if (n) {
+		commands = kmalloc_array(n, sizeof(*commands), GFP_KERNEL);
+		if (!commands)
+			return -ENOMEM;
+	}
+
+	spin_lock_irq(&fb->state_lock);
+	log = &fb->command_log;
+	if (!log->enable) {
+		spin_unlock_irq(&fb->state_lock);
+		ret = -EINVAL;
+		goto end;
+	}
+	n = min(n, log->count);
+	for (i = 0; i < n; i++)
+		commands[i] = log->commands[(log->head + i)
+					    % VGFBM_MAX_COMMANDS];
+	log->head = (log->head + n) % VGFBM_MAX_COMMANDS;
+	log->count -= n;
+	c.flags = 0;
+	if (log->overflow)
+		c.flags |= VGFBM_COMMANDS_OVERFLOW;
+	log->overflow = false;
+	if (log->count) {
+		/* It only applies after the remaining commands */
+		c.flags |= VGFBM_COMMANDS_MORE;
+	} else {
+		damage = log->damage;
+		log->damage = (struct vgfb_damage){ 0 };
+		log->bounds = (struct vgfb_damage){ 0 };
+	}
+	c.frame_seq = fb->frame_seq;
+	spin_unlock_irq(&fb->state_lock);
+
+	c.count = n;
+	c.damage = (struct vgfbm_damage){ 0 };
+	if (damage.x1 < damage.x2 && damage.y1 < damage.y2) {
+		c.damage.x = damage.x1;
+		c.damage.y = damage.y1;
+		c.damage.width = damage.x2 - damage.x1;
+		c.damage.height = damage.y2 - damage.y1;
+	}
+
+	if (n && copy_to_user(u64_to_user_ptr(c.buffer), commands,
+			      n * sizeof(*commands))) {
+		ret = -EFAULT;
+		goto end;
+	}
+	if (copy_to_user(arg, &c, sizeof(c)))
+		ret = -EFAULT;
+
+end:
+	kfree(commands);
+	return ret;
+}
+
+int vgfbm_get_cursor_user(struct fb_info *info,
+	struct vgfbm_cursor __user *arg)
+{
+	int ret = 0;
+	u32 *image;
+	u64 size;
+	struct vgfbm_cursor c;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (copy_from_user(&c, arg, sizeof(c)))
+		return -EFAULT;
+
+	image = kmalloc(sizeof(fb->cursor.image), GFP_KERNEL);
+	if (!image)
+		return -ENOMEM;
+
+	spin_lock_irq(&fb->state_lock);
+	/* From now on the guest's cursor goes to the plane */
+	fb->cursor.plane = true;
+	c.enable = fb->cursor.enable;
+	c.x = fb->cursor.x;
+	c.y = fb->cursor.y;
+	c.hot_x = fb->cursor.hot_x;
+	c.hot_y = fb->cursor.hot_y;
+	c.width = fb->cursor.width;
+	c.height = fb->cursor.height;
+	c.reserved = 0;
+	c.seq = fb->cursor.seq;
+	c.image_seq = fb->cursor.image_seq;
+	size = (u64)c.width * c.height * 4;
+	memcpy(image, fb->cursor.image, size);
+	fb->cursor.read_seq = fb->cursor.seq;
+	spin_unlock_irq(&fb->state_lock);
+
+	if (c.image && c.image_size >= size
+	 && copy_to_user(u64_to_user_ptr(c.image), image, size)) {
+		ret = -EFAULT;
+		goto end;
+	}
+	c.image_size = size;
+	if (copy_to_user(arg, &c, sizeof(c)))
+		ret = -EFAULT;
+
+end:
+	kfree(image);
+	return ret;
+}
+
+int vgfbm_take_snapshot_user(struct fb_info *info,
+	struct vgfbm_snapshot __user *arg)
+{
+	int ret;
+	bool console;
+	struct vgfbm_snapshot snap;
+	struct vgfbm *fb = *(struct vgfbm **)info->par;
+
+	if (!vgfb_lock(fb, info, &console))
+		return -ENODEV;
+	ret = vgfb_snapshot(info, &snap);
+	vgfb_unlock(fb, info, console);
+
+	if (ret < 0)
+		return ret;
+
+	if (copy_to_user(arg, &snap, sizeof(snap)))
+		return -EFAULT;
+
+	return 0;
+}
+
+int vgfbm_create_user(struct vgfbm *fb, const struct vgfbm_create __user *arg)
+{
+	int ret;
+	struct vgfbm_create c;
+
+	if (copy_from_user(&c, arg, sizeof(c)))
+		return -EFAULT;
+	if (!c.xres)
+		c.xres = VGFB_XRES;
+	if (!c.yres)
+		c.yres = VGFB_YRES;
+	if (!c.buffers)
+		c.buffers = VGFB_BUFFERS;
+	if (!c.refresh_rate)
+		c.refresh_rate = VGFB_REFRESH_RATE;
+	if (c.flags & ~VGFBM_CREATE_ALLOC_POLICY
+	 || !vgfbm_pitch_align_valid(c.pitch_align))
+		return -EINVAL;
+	if (c.buffers > VGFBM_MAX_BUFFERS
+	 || c.refresh_rate > VGFB_MAX_REFRESH_RATE)
+		return -EINVAL;
+	if (vgfbm_pitch(c.xres, c.pitch_align) * c.yres * c.buffers
+		> VGFBM_MMAP_STATUS)
+		return -EINVAL;
+	if (c.flags & VGFBM_CREATE_ALLOC_POLICY
+	 && vgfbm_alloc_policy_valid(&c.alloc) < 0)
+		return -EINVAL;
+
+	ret = vgfbm_create(fb, &c);
+	if (ret < 0)
+		return ret;
+	pr_debug("vgfbm: created %ux%u with %u buffers\n", c.xres, c.yres,
+		c.buffers);
+	return 0;
+}
+
+/* Observers can't take the master's damage */
+int vgfbm_read_thumbnail_user(struct fb_info *info,
+	struct vgfbm_thumbnail __user *arg, bool observer)
+{
+	int ret;
+	struct vgfbm_thumbnail t;
+
+	if (copy_from_user(&t, arg, sizeof(t)))
+		return -EFAULT;
+	if (t.reserved)
+		return -EINVAL;
+	if (observer && t.flags & VGFBM_THUMBNAIL_DAMAGE)
+		return -EINVAL;
+
+	if (!lock_fb_info(info))
+		return -ENODEV;
+	ret = vgfb_thumbnail(info, &t);
+	unlock_fb_info(info);
+
+	if (ret < 0)
+		return ret;
+
+	if (copy_to_user(arg, &t, sizeof(t)))
+		return -EFAULT;
+
+	return 0;
+}
+
 long vgfbmx_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	int ret = 0;
@@ -389,6 +1223,12 @@ long vgfbmx_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct vgfbm *vgfbm = file->private_data;
 	struct fb_info *info;
 
+	/* Anything else would create the device with defaults */
+	if (cmd == VGFBM_CREATE)
+		return vgfbm_create_user(vgfbm, argp);
+	if (cmd == VGFBM_SET_REMOVE_EVENT)
+		return vgfbm_set_remove_event_user(vgfbm, argp);
+
 	info = vgfbm_get_info(vgfbm);
 	if (!info)
 		return -ENODEV;
@@ -422,12 +1262,73 @@ long vgfbmx_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		ret = -EINVAL;
 		break;
 	case FBIOBLANK:
-		ret = 0;
+		ret = vgfb_set_blank(info, (int)arg, true);
 		break;
 	case VGFBM_GET_FB_MINOR:
 		tmp = info->node;
 		ret = copy_to_user(argp, &tmp, sizeof(int)) ? -EFAULT : 0;
 		break;
+	case VGFBM_READ_RECTS:
+		vgfbm_watched(vgfbm);
+		ret = vgfbm_rects_user(info, argp, false);
+		break;
+	case VGFBM_WRITE_RECTS:
+		ret = vgfbm_rects_user(info, argp, true);
+		break;
+	case VGFBM_GET_FRAME_STATE:
+		vgfbm_watched(vgfbm);
+		ret = vgfbm_get_frame_state_user(info, argp, 0);
+		break;
+	case VGFBM_ACK_FRAME:
+		vgfbm_watched(vgfbm);
+		ret = vgfbm_ack_frame_user(info, argp);
+		break;
+	case VGFBM_SET_PACING:
+		ret = vgfbm_set_pacing_user(info, argp);
+		break;
+	case VGFBM_SET_REFRESH_RATE:
+		ret = vgfbm_set_refresh_rate_user(info, argp);
+		break;
+	case VGFBM_SET_ALLOC_POLICY:
+		ret = vgfbm_set_alloc_policy_user(info, argp);
+		break;
+	case VGFBM_SET_RECLAIM_TIMEOUT:
+		ret = vgfbm_set_reclaim_timeout_user(info, argp);
+		break;
+	case VGFBM_SET_PITCH_ALIGN:
+		ret = vgfbm_set_pitch_align_user(info, argp);
+		break;
+	case VGFBM_GET_GUEST_STATE:
+		ret = vgfbm_get_guest_state_user(info, argp);
+		break;
+	case VGFBM_SET_IDLE_TIMEOUT:
+		ret = vgfbm_set_idle_timeout_user(info, argp);
+		break;
+	case VGFBM_SET_RING:
+		ret = vgfbm_set_ring_user(info, argp);
+		break;
+	case VGFBM_SET_COMMAND_LOG:
+		ret = vgfbm_set_command_log_user(info, argp);
+		break;
+	case VGFBM_READ_COMMANDS:
+		vgfbm_watched(vgfbm);
+		ret = vgfbm_read_commands_user(info, argp);
+		break;
+	case VGFBM_GET_CURSOR:
+		vgfbm_watched(vgfbm);
+		ret = vgfbm_get_cursor_user(info, argp);
+		break;
+	case VGFBM_TAKE_SNAPSHOT:
+		vgfbm_watched(vgfbm);
+		ret = vgfbm_take_snapshot_user(info, argp);
+		break;
+	case VGFBM_READ_THUMBNAIL:
+		/* Reads packed pages as they are, so it doesn't stop reclaim */
+		ret = vgfbm_read_thumbnail_user(info, argp, false);
+		break;
+	case VGFBM_RELEASE_SNAPSHOT:
+		vgfb_snapshot_release(vgfbm);
+		break;
 	default:
 		ret = -EINVAL;
 		break;
@@ -438,11 +1339,87 @@ long vgfbmx_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+/*
+ * Readable when there are unacknowledged frames or frames in the ring,
+ * priority on damage,
+ * read band on cursor changes not fetched by VGFBM_GET_CURSOR yet and
+ * message on guest state changes not fetched by VGFBM_GET_GUEST_STATE.
+ */
+__poll_t vgfbmx_poll(struct file *file, poll_table *wait)
+{
+	__poll_t mask = 0;
+	struct vgfbm *fb = file->private_data;
+
+	poll_wait(file, &fb->wait, wait);
+
+	spin_lock_irq(&fb->state_lock);
+	if (fb->frame_seq != fb->acked_seq)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (fb->damage.x1 < fb->damage.x2 && fb->damage.y1 < fb->damage.y2)
+		mask |= EPOLLPRI;
+	if (fb->cursor.seq != fb->cursor.read_seq)
+		mask |= EPOLLRDBAND;
+	if (fb->ring && vgfb_ring_pending(fb->ring))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (fb->guest_seq != fb->guest_read_seq)
+		mask |= EPOLLMSG;
+	spin_unlock_irq(&fb->state_lock);
+
+	return mask;
+}
+
+static void vgfbm_status_vm_open(struct vm_area_struct *vma)
+{
+	if (!vgfbm_acquire(vma->vm_private_data))
+		panic("vgfbm: vgfbm_acquire failed");
+}
+
+static void vgfbm_status_vm_close(struct vm_area_struct *vma)
+{
+	vgfbm_release(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct vgfbm_status_vm_ops = {
+	.open = vgfbm_status_vm_open,
+	.close = vgfbm_status_vm_close,
+};
+
+int vgfbm_status_mmap(struct vgfbm *vgfbm, struct vm_area_struct *vma)
+{
+	int ret;
+
+	if (vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (!vgfbm_acquire(vgfbm))
+		return -EAGAIN;
+	ret = remap_vmalloc_range(vma, vgfbm->status, 0);
+	if (ret < 0) {
+		pr_err("vgfbm: remap_vmalloc_range failed (%d)\n", ret);
+		vgfbm_release(vgfbm);
+		return ret;
+	}
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = vgfbm;
+	vma->vm_ops = &vgfbm_status_vm_ops;
+	return 0;
+}
+
 int vgfbmx_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	int ret;
-	struct fb_info *info = vgfbm_get_info(file->private_data);
+	struct fb_info *info;
+
+	if (vma->vm_pgoff == VGFBM_MMAP_STATUS >> PAGE_SHIFT)
+		return vgfbm_status_mmap(file->private_data, vma);
+	if (vma->vm_pgoff >= VGFBM_MMAP_SNAPSHOT >> PAGE_SHIFT)
+		return vgfb_snapshot_mmap_current(file->private_data, vma);
+	if (vma->vm_pgoff >= VGFBM_MMAP_RING >> PAGE_SHIFT)
+		return vgfb_ring_mmap_current(file->private_data, vma);
 
+	info = vgfbm_get_info(file->private_data);
 	if (!info)
 		return -ENODEV;
 	if (!lock_fb_info(info)) {
@@ -461,8 +1438,13 @@ const struct file_operations vgfbmx_opts = {
 	.open = vgfbmx_open,
 	.release = vgfbmx_close,
 	.unlocked_ioctl = vgfbmx_ioctl,
+	.poll = vgfbmx_poll,
 	.read = vgfbmx_read,
 	.write = vgfbmx_write,
+	.read_iter = vgfbmx_read_iter,
+	.write_iter = vgfbmx_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
 	.mmap = vgfbmx_mmap,
 };
 
@@ -482,7 +1464,8 @@ int __init vgfbmx_init(void)
 
 	vgfbmx.cdev->ops = &vgfbmx_opts;
 	vgfbmx.cdev->owner = THIS_MODULE;
-	ret = alloc_chrdev_region(&dev_major, 0, 1, "vgfbmx");
+	/* The second minor is /dev/vgfbmo, see vgfbmo.c */
+	ret = alloc_chrdev_region(&dev_major, 0, 2, "vgfbmx");
 	if (ret) {
 		pr_err("vgfbmx: Failed to register chrdev\n");
 		goto failed_after_cdev_alloc;
@@ -512,20 +1495,43 @@ int __init vgfbmx_init(void)
 	pr_info("vgfbmx: Initialised, device major number: %d\n",
 		vgfbmx.major);
 
+	ret = vgfbmo_init(vgfbmx.vgfb_class, MKDEV(vgfbmx.major, 1));
+	if (ret) {
+		pr_err("vgfbmx: vgfbmo_init failed\n");
+		goto failed_after_device_create;
+	}
+
+	vgfbm_remove_wq = alloc_workqueue("vgfbm_remove", WQ_UNBOUND, 0);
+	if (!vgfbm_remove_wq) {
+		pr_err("vgfbmx: Failed to allocate workqueue\n");
+		ret = -ENOMEM;
+		goto failed_after_vgfbmo_init;
+	}
+
 	ret = vgfb_init();
 	if (ret) {
 		pr_err("vgfbmx: vgfb_init failed\n");
-		goto failed_after_device_create;
+		goto failed_after_alloc_workqueue;
 	}
 
+	mutex_lock(&vgfbm_dedup_lock);
+	vgfbm_dedup_ready = true;
+	if (READ_ONCE(dedup_interval_ms))
+		queue_delayed_work(system_unbound_wq, &vgfbm_dedup_work, 0);
+	mutex_unlock(&vgfbm_dedup_lock);
+
 	return 0;
 
+failed_after_alloc_workqueue:
+	destroy_workqueue(vgfbm_remove_wq);
+failed_after_vgfbmo_init:
+	vgfbmo_exit();
 failed_after_device_create:
 	device_destroy(vgfbmx.vgfb_class, vgfbmx.dev);
 failed_after_class_create:
 	class_destroy(vgfbmx.vgfb_class);
 failed_after_alloc_chrdev_region:
-	unregister_chrdev_region(vgfbmx.dev, 1);
+	unregister_chrdev_region(vgfbmx.dev, 2);
 failed_after_cdev_alloc:
 	cdev_del(vgfbmx.cdev);
 failed:
@@ -536,11 +1542,18 @@ void __exit vgfbmx_exit(void)
 {
 	pr_info("vgfbmx: Unloading device\n");
 
+	mutex_lock(&vgfbm_dedup_lock);
+	vgfbm_dedup_ready = false;
+	mutex_unlock(&vgfbm_dedup_lock);
+	cancel_delayed_work_sync(&vgfbm_dedup_work);
+	/* Finishes the pending teardowns while the driver is still there */
+	destroy_workqueue(vgfbm_remove_wq);
 	vgfb_exit();
+	vgfbmo_exit();
 
 	device_destroy(vgfbmx.vgfb_class, vgfbmx.dev);
 	class_destroy(vgfbmx.vgfb_class);
-	unregister_chrdev_region(vgfbmx.dev, 1);
+	unregister_chrdev_region(vgfbmx.dev, 2);
 	cdev_del(vgfbmx.cdev);
 }
 
@@ -5,6 +5,23 @@ struct vgfbm;
 struct fb_info;
 struct fb_var_screeninfo;
 struct fb_fix_screeninfo;
+struct kiocb;
+struct iov_iter;
+struct vgfbm_rects;
+struct vgfbm_frame_state;
+struct vgfbm_pacing;
+struct vgfbm_alloc_policy;
+struct vgfbm_cursor;
+struct vgfbm_snapshot;
+struct vgfbm_create;
+struct vgfbm_thumbnail;
+struct vgfbm_guest_state;
+struct vgfbm_ring_setup;
+struct vgfbm_observer;
+struct vgfbm_commands;
+struct vm_area_struct;
+struct poll_table_struct;
+struct work_struct;
 
 int vgfbm_get_vscreeninfo_user(const struct fb_info *info,
 	struct fb_var_screeninfo __user *var);
@@ -14,6 +31,41 @@ int vgfbm_get_fscreeninfo_user(const struct fb_info *info,
 	struct fb_fix_screeninfo __user *var);
 int vgfbm_pan_display(struct fb_info *info,
 	const struct fb_var_screeninfo __user *var);
+int vgfbm_rects_user(struct fb_info *info,
+	const struct vgfbm_rects __user *arg, bool write);
+int vgfbm_get_frame_state_user(struct fb_info *info,
+	struct vgfbm_frame_state __user *arg, struct vgfbm_observer *obs);
+int vgfbm_ack_frame_user(struct fb_info *info, const __u64 __user *arg);
+int vgfbm_set_pacing_user(struct fb_info *info,
+	const struct vgfbm_pacing __user *arg);
+int vgfbm_set_refresh_rate_user(struct fb_info *info,
+	const __u32 __user *arg);
+int vgfbm_set_alloc_policy_user(struct fb_info *info,
+	const struct vgfbm_alloc_policy __user *arg);
+int vgfbm_set_pitch_align_user(struct fb_info *info,
+	const __u32 __user *arg);
+int vgfbm_get_guest_state_user(struct fb_info *info,
+	struct vgfbm_guest_state __user *arg);
+int vgfbm_set_idle_timeout_user(struct fb_info *info,
+	const __u32 __user *arg);
+int vgfbm_set_ring_user(struct fb_info *info,
+	struct vgfbm_ring_setup __user *arg);
+int vgfbm_set_command_log_user(struct fb_info *info,
+	const __u32 __user *arg);
+int vgfbm_read_commands_user(struct fb_info *info,
+	struct vgfbm_commands __user *arg);
+int vgfbm_set_reclaim_timeout_user(struct fb_info *info,
+	const __u32 __user *arg);
+int vgfbm_get_cursor_user(struct fb_info *info,
+	struct vgfbm_cursor __user *arg);
+int vgfbm_take_snapshot_user(struct fb_info *info,
+	struct vgfbm_snapshot __user *arg);
+int vgfbm_create_user(struct vgfbm *fb, const struct vgfbm_create __user *arg);
+int vgfbm_set_remove_event_user(struct vgfbm *vgfbm, const __s32 __user *arg);
+void vgfbm_remove_work(struct work_struct *work);
+int vgfbm_read_thumbnail_user(struct fb_info *info,
+	struct vgfbm_thumbnail __user *arg, bool observer);
+int vgfbm_status_mmap(struct vgfbm *vgfbm, struct vm_area_struct *vma);
 int vgfbm_set_vscreeninfo(struct fb_info *info,
 	struct fb_var_screeninfo *var);
 int vgfbm_set_par(struct fb_info *info);
@@ -23,7 +75,10 @@ ssize_t vgfbmx_read(struct file *file, char __user *buf, size_t count,
 	loff_t *ppos);
 ssize_t vgfbmx_write(struct file *file, const char __user *buf, size_t count,
 	loff_t *ppos);
+ssize_t vgfbmx_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t vgfbmx_write_iter(struct kiocb *iocb, struct iov_iter *from);
 long vgfbmx_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+__poll_t vgfbmx_poll(struct file *file, struct poll_table_struct *wait);
 int vgfbmx_open(struct inode *inode, struct file *file);
 int vgfbmx_close(struct inode *inode, struct file *file);
 int vgfbmx_mmap(struct file *file, struct vm_area_struct *vma);
@@ -31,6 +86,8 @@ int vgfbm_set_resolution(struct fb_info *info,
 			const unsigned long resolution[2]);
 
 struct fb_info *vgfbm_get_info(struct vgfbm *vgfbm);
+struct fb_info *vgfbm_get_existing_info(struct vgfbm *vgfbm);
+struct vgfbm *vgfbm_find(int minor);
 void vgfbm_put_info(struct fb_info *info);
 
 bool vgfbm_acquire(struct vgfbm *vgfbm);
@@ -0,0 +1,172 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <vgfbm.hpp>
+
+/*
+ * Flips the given number of devices as fast as the capture loop keeps up
+ * and reads every frame, through the mapping, VGFBM_READ_RECTS or a 1/4
+ * thumbnail. Reports frames and bytes read per second.
+ */
+
+enum mode {
+	MODE_MMAP,
+	MODE_RECTS,
+	MODE_THUMBNAIL,
+};
+
+static void usage(const char *name)
+{
+	std::fprintf(stderr,
+		"usage: %s [-d devices] [-s seconds] [-x xres] [-y yres]"
+		" [-m mmap|rects|thumbnail]\n", name);
+	std::exit(2);
+}
+
+/* Reads every damaged pixel, so the mapping is actually touched */
+static std::uint64_t read_mapped(const vgfbm::frame &f, std::uint64_t &sum)
+{
+	std::uint32_t x, y;
+	const std::uint32_t *row;
+
+	for (y = 0; y < f.damage.height; y++) {
+		row = reinterpret_cast<const std::uint32_t *>(
+			f.data + (std::size_t)(f.damage.y + y) * f.stride)
+			+ f.damage.x;
+		for (x = 0; x < f.damage.width; x++)
+			sum += row[x];
+	}
+	return (std::uint64_t)f.damage.width * f.damage.height * 4;
+}
+
+static std::uint64_t read_rects(vgfbm::device &dev, const vgfbm::frame &f,
+	std::vector<std::uint8_t> &buf)
+{
+	vgfbm_rect rect = {};
+	vgfbm_rects rects = {};
+
+	rect.x = f.damage.x;
+	rect.y = f.damage.y;
+	rect.width = f.damage.width;
+	rect.height = f.damage.height;
+	buf.resize((std::size_t)rect.width * rect.height * 4);
+	rects.buffer = reinterpret_cast<std::uintptr_t>(buf.data());
+	rects.buffer_size = buf.size();
+	rects.rects = reinterpret_cast<std::uintptr_t>(&rect);
+	rects.count = 1;
+	rects.stride = rect.width * 4;
+	if (ioctl(dev.fd(), VGFBM_READ_RECTS, &rects) < 0)
+		throw std::system_error(errno, std::generic_category(),
+					"VGFBM_READ_RECTS");
+	return buf.size();
+}
+
+static std::uint64_t read_thumbnail(vgfbm::device &dev, const vgfbm::frame &f,
+	std::vector<std::uint8_t> &buf)
+{
+	vgfbm_thumbnail t = {};
+
+	t.shift = 2;
+	t.flags = VGFBM_THUMBNAIL_BOX;
+	t.area = f.damage;
+	t.stride = (f.width >> t.shift) * 4;
+	buf.resize((std::size_t)t.stride * (f.height >> t.shift));
+	t.buffer = reinterpret_cast<std::uintptr_t>(buf.data());
+	t.buffer_size = buf.size();
+	if (ioctl(dev.fd(), VGFBM_READ_THUMBNAIL, &t) < 0)
+		throw std::system_error(errno, std::generic_category(),
+					"VGFBM_READ_THUMBNAIL");
+	return (std::uint64_t)t.area.width * t.area.height * 4;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	unsigned i, devices = 1, seconds = 5;
+	enum mode mode = MODE_MMAP;
+	vgfbm_create params = {};
+	std::uint64_t frames = 0, bytes = 0, sum = 0, flips = 0;
+	std::vector<std::uint8_t> buf;
+
+	params.xres = 1920;
+	params.yres = 1080;
+	while ((opt = getopt(argc, argv, "d:s:x:y:m:")) != -1) {
+		switch (opt) {
+		case 'd': devices = std::strtoul(optarg, nullptr, 0); break;
+		case 's': seconds = std::strtoul(optarg, nullptr, 0); break;
+		case 'x': params.xres = std::strtoul(optarg, nullptr, 0); break;
+		case 'y': params.yres = std::strtoul(optarg, nullptr, 0); break;
+		case 'm':
+			if (!std::strcmp(optarg, "mmap"))
+				mode = MODE_MMAP;
+			else if (!std::strcmp(optarg, "rects"))
+				mode = MODE_RECTS;
+			else if (!std::strcmp(optarg, "thumbnail"))
+				mode = MODE_THUMBNAIL;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!devices || !seconds)
+		usage(argv[0]);
+
+	try {
+		std::vector<vgfbm::device> devs;
+		vgfbm::capture_loop loop;
+
+		params.buffers = 2;
+		for (i = 0; i < devices; i++) {
+			devs.emplace_back();
+			devs.back().create(params);
+		}
+		for (auto &dev : devs) {
+			loop.add(dev, [&](vgfbm::device &d, const vgfbm::frame &f) {
+				frames++;
+				if (!f.damage.width)
+					return;
+				switch (mode) {
+				case MODE_MMAP:
+					bytes += read_mapped(f, sum);
+					break;
+				case MODE_RECTS:
+					bytes += read_rects(d, f, buf);
+					break;
+				case MODE_THUMBNAIL:
+					bytes += read_thumbnail(d, f, buf);
+					break;
+				}
+			});
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + std::chrono::seconds(seconds);
+		while (std::chrono::steady_clock::now() < end) {
+			for (auto &dev : devs)
+				dev.pan(flips & 1 ? params.yres : 0);
+			flips++;
+			while (loop.poll(0))
+				;
+		}
+		std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+
+		std::printf("%u devices %ux%u: %.1f frames/s, %.1f MB/s"
+			    " (checksum %llx)\n", devices, params.xres,
+			    params.yres, frames / elapsed.count(),
+			    bytes / elapsed.count() / 1e6,
+			    (unsigned long long)sum);
+	} catch (const std::system_error &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
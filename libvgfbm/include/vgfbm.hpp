@@ -0,0 +1,100 @@
+#ifndef VGFBM_HPP
+#define VGFBM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <vg.h>
+
+namespace vgfbm {
+
+/*
+ * The shown frame of a device, pointing straight into its mapped screen
+ * memory. It stays valid until the next frame of the same device is
+ * fetched, which may remap the memory. damage is in frame coordinates and
+ * covers the whole frame after a remap.
+ */
+struct frame {
+	const std::uint8_t *data;
+	std::uint32_t width;
+	std::uint32_t height;
+	std::uint32_t stride;
+	std::uint64_t frame_seq;
+	std::uint64_t generation;
+	vgfbm_damage damage;
+	bool remapped;
+};
+
+/*
+ * A master handle, owning one framebuffer device. The device is created
+ * with defaults by the first operation needing it, unless create() was
+ * called before. Errors are thrown as std::system_error.
+ */
+class device {
+public:
+	explicit device(const char *path = "/dev/vgfbmx");
+	~device();
+	device(device &&other) noexcept;
+	device &operator=(device &&other) noexcept;
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	void create(const vgfbm_create &params);
+	int fd() const noexcept { return fd_; }
+	int fb_minor() const;
+	vgfbm_status status() const;
+	frame next_frame();
+	void ack(std::uint64_t frame_seq);
+	void pan(std::uint32_t yoffset);
+
+private:
+	void close() noexcept;
+	void remap(vgfbm_frame_state &state);
+
+	int fd_ = -1;
+	const vgfbm_status *status_ = nullptr;
+	std::uint8_t *screen_ = nullptr;
+	std::size_t screen_size_ = 0;
+	std::uint64_t generation_ = 0;
+	bool mapped_ = false;
+};
+
+/*
+ * Waits on any number of devices with epoll and hands each new frame to
+ * the handler of its device, acknowledging it afterwards. Devices must
+ * outlive the loop or be removed first. stop() may be called from any
+ * thread, or from a handler.
+ */
+class capture_loop {
+public:
+	using handler = std::function<void(device &, const frame &)>;
+
+	capture_loop();
+	~capture_loop();
+	capture_loop(const capture_loop &) = delete;
+	capture_loop &operator=(const capture_loop &) = delete;
+
+	void add(device &dev, handler h);
+	void remove(device &dev);
+	std::size_t poll(int timeout_ms);
+	void run();
+	void stop();
+
+private:
+	struct entry {
+		device *dev;
+		handler h;
+		std::uint64_t frame_seq;
+	};
+
+	int epoll_ = -1;
+	int wake_ = -1;
+	bool stopped_ = false;
+	std::vector<std::unique_ptr<entry>> entries_;
+};
+
+}
+
+#endif
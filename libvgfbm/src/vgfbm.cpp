@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <vgfbm.hpp>
+
+namespace vgfbm {
+
+[[noreturn]] static void fail(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+device::device(const char *path)
+{
+	void *status;
+
+	fd_ = ::open(path, O_RDWR | O_CLOEXEC);
+	if (fd_ < 0)
+		fail(path);
+	status = mmap(nullptr, sizeof(vgfbm_status), PROT_READ, MAP_SHARED, fd_,
+		      VGFBM_MMAP_STATUS);
+	if (status == MAP_FAILED) {
+		int err = errno;
+		::close(fd_);
+		errno = err;
+		fail("mmap status");
+	}
+	status_ = static_cast<const vgfbm_status *>(status);
+}
+
+device::~device()
+{
+	close();
+}
+
+device::device(device &&other) noexcept
+	: fd_(other.fd_), status_(other.status_), screen_(other.screen_),
+	  screen_size_(other.screen_size_), generation_(other.generation_),
+	  mapped_(other.mapped_)
+{
+	other.fd_ = -1;
+	other.status_ = nullptr;
+	other.screen_ = nullptr;
+	other.mapped_ = false;
+}
+
+device &device::operator=(device &&other) noexcept
+{
+	if (this == &other)
+		return *this;
+	close();
+	fd_ = other.fd_;
+	status_ = other.status_;
+	screen_ = other.screen_;
+	screen_size_ = other.screen_size_;
+	generation_ = other.generation_;
+	mapped_ = other.mapped_;
+	other.fd_ = -1;
+	other.status_ = nullptr;
+	other.screen_ = nullptr;
+	other.mapped_ = false;
+	return *this;
+}
+
+void device::close() noexcept
+{
+	if (mapped_)
+		munmap(screen_, screen_size_);
+	if (status_)
+		munmap(const_cast<vgfbm_status *>(status_),
+		       sizeof(vgfbm_status));
+	if (fd_ >= 0)
+		::close(fd_);
+	mapped_ = false;
+	screen_ = nullptr;
+	status_ = nullptr;
+	fd_ = -1;
+}
+
+void device::create(const vgfbm_create &params)
+{
+	if (ioctl(fd_, VGFBM_CREATE, &params) < 0)
+		fail("VGFBM_CREATE");
+}
+
+int device::fb_minor() const
+{
+	int minor;
+
+	if (ioctl(fd_, VGFBM_GET_FB_MINOR, &minor) < 0)
+		fail("VGFBM_GET_FB_MINOR");
+	return minor;
+}
+
+/* The status page is a seqlock, seq is odd while the driver updates it */
+vgfbm_status device::status() const
+{
+	vgfbm_status s;
+	std::uint32_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&status_->seq, __ATOMIC_ACQUIRE);
+		std::memcpy(&s, status_, sizeof(s));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(seq & 1)
+		 && seq == __atomic_load_n(&status_->seq, __ATOMIC_RELAXED))
+			return s;
+	}
+}
+
+/*
+ * Mappings of an old screen buffer stop showing the screen once the
+ * generation changes, so map the current one instead. A resize between
+ * getting state and the mmap maps the new buffer with the old size, or
+ * fails if that got smaller, so state is fetched again afterwards and the
+ * mapping redone until the generation holds. state ends up the latest.
+ */
+void device::remap(vgfbm_frame_state &state)
+{
+	void *screen;
+	vgfbm_frame_state again;
+
+	for (;;) {
+		if (mapped_) {
+			munmap(screen_, screen_size_);
+			mapped_ = false;
+		}
+		screen = mmap(nullptr, state.fix.smem_len, PROT_READ,
+			      MAP_SHARED, fd_, 0);
+		if (screen != MAP_FAILED) {
+			screen_ = static_cast<std::uint8_t *>(screen);
+			screen_size_ = state.fix.smem_len;
+			generation_ = state.generation;
+			mapped_ = true;
+		} else if (errno != EINVAL) {
+			fail("mmap screen");
+		}
+		if (ioctl(fd_, VGFBM_GET_FRAME_STATE, &again) < 0)
+			fail("VGFBM_GET_FRAME_STATE");
+		if (again.generation == state.generation) {
+			if (!mapped_) {
+				errno = EINVAL;
+				fail("mmap screen");
+			}
+			state = again;
+			return;
+		}
+		state = again;
+	}
+}
+
+frame device::next_frame()
+{
+	frame f;
+	vgfbm_frame_state state;
+	std::uint32_t y1, y2;
+
+	if (ioctl(fd_, VGFBM_GET_FRAME_STATE, &state) < 0)
+		fail("VGFBM_GET_FRAME_STATE");
+	f.remapped = !mapped_ || state.generation != generation_;
+	if (f.remapped)
+		remap(state);
+
+	f.width = state.var.xres;
+	f.height = state.var.yres;
+	f.stride = state.fix.line_length;
+	f.frame_seq = state.frame_seq;
+	f.generation = state.generation;
+	if ((std::uint64_t)(state.var.yoffset + f.height) * f.stride
+	    > screen_size_) {
+		errno = ERANGE;
+		fail("frame outside the mapping");
+	}
+	f.data = screen_ + (std::size_t)state.var.yoffset * f.stride;
+
+	/* The driver reports damage in virtual screen coordinates */
+	f.damage = vgfbm_damage{};
+	if (f.remapped) {
+		f.damage = vgfbm_damage{ 0, 0, f.width, f.height };
+	} else if (state.damage.width) {
+		y1 = std::max(state.damage.y, state.var.yoffset);
+		y2 = std::min(state.damage.y + state.damage.height,
+			      state.var.yoffset + f.height);
+		if (y1 < y2 && state.damage.x < f.width)
+			f.damage = vgfbm_damage{ state.damage.x,
+				y1 - state.var.yoffset,
+				std::min(state.damage.width,
+					 f.width - state.damage.x),
+				y2 - y1 };
+	}
+	return f;
+}
+
+void device::ack(std::uint64_t frame_seq)
+{
+	__u64 seq = frame_seq;
+
+	if (ioctl(fd_, VGFBM_ACK_FRAME, &seq) < 0)
+		fail("VGFBM_ACK_FRAME");
+}
+
+void device::pan(std::uint32_t yoffset)
+{
+	fb_var_screeninfo var;
+
+	if (ioctl(fd_, FBIOGET_VSCREENINFO, &var) < 0)
+		fail("FBIOGET_VSCREENINFO");
+	var.yoffset = yoffset;
+	if (ioctl(fd_, FBIOPAN_DISPLAY, &var) < 0)
+		fail("FBIOPAN_DISPLAY");
+}
+
+capture_loop::capture_loop()
+{
+	epoll_event ev = {};
+
+	epoll_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_ < 0)
+		fail("epoll_create1");
+	wake_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wake_ < 0) {
+		int err = errno;
+		::close(epoll_);
+		errno = err;
+		fail("eventfd");
+	}
+	/* A null data.ptr stands for the wake up event */
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;
+	if (epoll_ctl(epoll_, EPOLL_CTL_ADD, wake_, &ev) < 0) {
+		int err = errno;
+		::close(wake_);
+		::close(epoll_);
+		errno = err;
+		fail("epoll_ctl");
+	}
+}
+
+capture_loop::~capture_loop()
+{
+	::close(wake_);
+	::close(epoll_);
+}
+
+/* Unacknowledged frames make the device readable, damage priority */
+void capture_loop::add(device &dev, handler h)
+{
+	epoll_event ev = {};
+	std::unique_ptr<entry> e(new entry{ &dev, std::move(h), 0 });
+
+	ev.events = EPOLLIN | EPOLLPRI;
+	ev.data.ptr = e.get();
+	if (epoll_ctl(epoll_, EPOLL_CTL_ADD, dev.fd(), &ev) < 0)
+		fail("epoll_ctl");
+	entries_.push_back(std::move(e));
+}
+
+/* Not from within a handler, the loop may still hold the entry */
+void capture_loop::remove(device &dev)
+{
+	auto it = std::find_if(entries_.begin(), entries_.end(),
+		[&](const std::unique_ptr<entry> &e) { return e->dev == &dev; });
+
+	if (it == entries_.end())
+		return;
+	epoll_ctl(epoll_, EPOLL_CTL_DEL, dev.fd(), nullptr);
+	entries_.erase(it);
+}
+
+/* Waits for one round of events, returns the number of frames handled */
+std::size_t capture_loop::poll(int timeout_ms)
+{
+	int i, n;
+	std::uint64_t count;
+	std::size_t handled = 0;
+	epoll_event events[32];
+
+	n = epoll_wait(epoll_, events, 32, timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		fail("epoll_wait");
+	}
+	for (i = 0; i < n; i++) {
+		entry *e = static_cast<entry *>(events[i].data.ptr);
+
+		if (!e) {
+			if (read(wake_, &count, sizeof(count)) < 0
+			 && errno != EAGAIN)
+				fail("read eventfd");
+			stopped_ = true;
+			continue;
+		}
+		frame f = e->dev->next_frame();
+		if (f.remapped || f.damage.width || f.frame_seq != e->frame_seq) {
+			e->h(*e->dev, f);
+			handled++;
+		}
+		e->frame_seq = f.frame_seq;
+		e->dev->ack(f.frame_seq);
+	}
+	return handled;
+}
+
+void capture_loop::run()
+{
+	stopped_ = false;
+	while (!stopped_)
+		poll(-1);
+}
+
+void capture_loop::stop()
+{
+	std::uint64_t one = 1;
+
+	if (write(wake_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fail("write eventfd");
+}
+
+}
@@ -0,0 +1,188 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <vgfbm.hpp>
+
+/*
+ * Runs the library against the loaded driver: creating a device, the
+ * frame state and mapping, rect reads and writes, the capture loop and a
+ * resize. Exits with 77, which make check reports as skipped, if there's
+ * no /dev/vgfbmx.
+ */
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			std::fprintf(stderr, "%s:%d: %s failed\n",	\
+				     __FILE__, __LINE__, #cond);	\
+			std::exit(1);					\
+		}							\
+	} while (0)
+
+static const char *path = "/dev/vgfbmx";
+
+static std::uint32_t pattern(std::uint32_t x, std::uint32_t y)
+{
+	return (y << 16) ^ x ^ 0x5a5a5a5a;
+}
+
+static bool covers(const vgfbm_damage &d, const vgfbm_rect &r)
+{
+	return d.x <= r.x && d.y <= r.y && d.x + d.width >= r.x + r.width
+	    && d.y + d.height >= r.y + r.height;
+}
+
+static void rects_io(vgfbm::device &dev, unsigned long cmd,
+	const vgfbm_rect &rect, std::vector<std::uint32_t> &buf)
+{
+	vgfbm_rects rects = {};
+
+	rects.buffer = reinterpret_cast<std::uintptr_t>(buf.data());
+	rects.buffer_size = buf.size() * 4;
+	rects.rects = reinterpret_cast<std::uintptr_t>(&rect);
+	rects.count = 1;
+	rects.stride = rect.width * 4;
+	if (ioctl(dev.fd(), cmd, &rects) < 0)
+		throw std::system_error(errno, std::generic_category(),
+			cmd == VGFBM_READ_RECTS ? "VGFBM_READ_RECTS"
+						: "VGFBM_WRITE_RECTS");
+}
+
+static void test_create(vgfbm::device &dev)
+{
+	vgfbm_create params = {};
+	vgfbm_status s;
+	vgfbm::frame f;
+
+	params.xres = 640;
+	params.yres = 480;
+	params.buffers = 2;
+	dev.create(params);
+	CHECK(dev.fb_minor() >= 0);
+
+	s = dev.status();
+	CHECK(!(s.seq & 1));
+	CHECK(s.xres == 640 && s.yres == 480);
+	CHECK(s.yres_virtual == 960);
+
+	f = dev.next_frame();
+	CHECK(f.remapped);
+	CHECK(f.width == 640 && f.height == 480);
+	CHECK(f.stride >= 640 * 4);
+	CHECK(f.damage.width == 640 && f.damage.height == 480);
+}
+
+/* Pixels written with VGFBM_WRITE_RECTS show up in the mapping and reads */
+static void test_rects(vgfbm::device &dev)
+{
+	std::uint32_t x, y;
+	vgfbm_rect rect = {};
+	vgfbm::frame f;
+	std::vector<std::uint32_t> in, out;
+
+	rect.x = 16;
+	rect.y = 8;
+	rect.width = 64;
+	rect.height = 32;
+	in.resize(rect.width * rect.height);
+	out.resize(in.size());
+	for (y = 0; y < rect.height; y++)
+		for (x = 0; x < rect.width; x++)
+			in[y * rect.width + x] = pattern(x, y);
+	rects_io(dev, VGFBM_WRITE_RECTS, rect, in);
+
+	f = dev.next_frame();
+	CHECK(!f.remapped);
+	CHECK(covers(f.damage, rect));
+	for (y = 0; y < rect.height; y++)
+		CHECK(!std::memcmp(f.data + (std::size_t)(rect.y + y) * f.stride
+				   + rect.x * 4, &in[y * rect.width],
+				   rect.width * 4));
+
+	rects_io(dev, VGFBM_READ_RECTS, rect, out);
+	CHECK(in == out);
+}
+
+/* Pans show up as frames in the loop, which stops from a handler */
+static void test_capture_loop(vgfbm::device &dev)
+{
+	int i;
+	std::size_t frames = 0;
+	std::uint64_t seq = dev.status().frame_seq;
+	vgfbm::capture_loop loop;
+
+	loop.add(dev, [&](vgfbm::device &, const vgfbm::frame &f) {
+		CHECK(f.frame_seq > seq);
+		seq = f.frame_seq;
+		frames++;
+	});
+	dev.pan(480);
+	for (i = 0; i < 100 && !frames; i++)
+		loop.poll(10);
+	CHECK(frames == 1);
+	CHECK(dev.status().yoffset == 480);
+
+	loop.remove(dev);
+	loop.add(dev, [&](vgfbm::device &, const vgfbm::frame &) {
+		frames++;
+		loop.stop();
+	});
+	dev.pan(0);
+	loop.run();
+	CHECK(frames == 2);
+	loop.remove(dev);
+}
+
+/* A resize replaces the buffer, the next frame comes from a new mapping */
+static void test_resize(vgfbm::device &dev)
+{
+	fb_var_screeninfo var;
+	vgfbm::frame f;
+	const volatile std::uint8_t *last;
+	std::uint64_t generation = dev.status().generation;
+
+	CHECK(ioctl(dev.fd(), FBIOGET_VSCREENINFO, &var) == 0);
+	var.xres = 800;
+	var.yres = 600;
+	var.yoffset = 0;
+	var.activate = FB_ACTIVATE_NOW;
+	CHECK(ioctl(dev.fd(), FBIOPUT_VSCREENINFO, &var) == 0);
+
+	f = dev.next_frame();
+	CHECK(f.remapped);
+	CHECK(f.generation != generation);
+	CHECK(f.width == 800 && f.height == 600);
+	CHECK(f.stride >= 800 * 4);
+	CHECK(f.damage.width == 800 && f.damage.height == 600);
+	/* Touches the last pixel, which the old mapping didn't cover */
+	last = f.data + (std::size_t)(f.height - 1) * f.stride
+	       + (f.width - 1) * 4;
+	(void)*last;
+}
+
+int main()
+{
+	if (access(path, R_OK | W_OK) < 0) {
+		std::printf("skipped: %s: %s\n", path, std::strerror(errno));
+		return 77;
+	}
+
+	try {
+		vgfbm::device dev(path);
+
+		test_create(dev);
+		test_rects(dev);
+		test_capture_loop(dev);
+		test_resize(dev);
+	} catch (const std::system_error &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	std::printf("ok\n");
+	return 0;
+}